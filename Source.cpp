@@ -1,6 +1,7 @@
 
 #include "rrf_write.h"
 #include "rrf_read.h"
+#include "rrf_server.h"
 
 #include <filesystem>
 
@@ -99,20 +100,207 @@ void run_test_set() {
 }
 
 
+// Decodes damaged copies of a good rrf, only a crash (or a sanitizer report) is a failure.
+// Half of the rounds damage the file itself, the others damage one decompressed stream and store everything raw again
+// so the stream decoders see the damage instead of LZMA.
+bool run_corrupt_test(const char* input_file, const size_t rounds) {
+
+	const auto input{ read_file(input_file) };
+
+	_rrf_frames frames{};
+
+	if (input.empty() || decode_frames(input.data(), input.size(), frames) == 0)
+		return 0;
+
+	const auto& streams{ frames.stream_data.data };
+
+	u64 seed{ 88172645463325252ull };
+
+	const auto random = [&]() {
+		seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+		return seed;
+	};
+
+	size_t decoded{};
+
+	std::vector<u8> file{}, output{};
+
+	for (size_t r{}; r < rounds; ++r) {
+
+		if (r & 1) {
+
+			file = input;
+
+			if (random() & 1)
+				file.resize(random() % file.size());
+			else for (size_t i{}, count{ 1 + random() % 8 }; i < count; ++i)
+				file[random() % file.size()] ^= u8(1 << (random() & 7));
+
+		} else {
+
+			auto stream{ streams };
+
+			if (auto& d{ stream[random() % stream.size()].data }; d.size()) {
+
+				if (random() & 1)
+					d.resize(random() % d.size());
+
+				for (size_t i{}, count{ d.size() ? 1 + random() % 8 : 0 }; i < count; ++i) {
+
+					u8& v{ d[random() % d.size()] };
+
+					v = (random() & 3) ? u8(v ^ (1 << (random() & 7))) : u8(random());
+				}
+
+			}
+
+			_rrf_header header{ frames.header };
+			header.data_count = u32(stream.size());
+
+			if ((random() & 7) == 0)
+				header.frame_count = u32(random() % (2 * u64(header.frame_count) + 2));
+
+			file.resize(sizeof(header));
+			memcpy(file.data(), &header, sizeof(header));
+
+			for (const auto& s : stream)
+				file.push_back(s.tag);
+
+			for (const auto& s : stream) {
+
+				_rrf_data_block block{};
+				block.size = u32(s.data.size());
+
+				add_to_u8(file, (const u8*)&block, sizeof(block));
+			}
+
+			for (const auto& s : stream)
+				add_to_u8(file, s.data);
+
+		}
+
+		decoded += rrf_to_osr(file.data(), file.size(), output);
+
+	}
+
+	printf("%zu/%zu damaged files decoded\n", decoded, rounds);
+
+	return 1;
+}
+
+// A cursor that only moves on a 4 osu!pixel grid and rarely holds a key, the lowfi step can be 4 times coarser there
+// without moving anything, so the speculative encoder has to pick something other than the rule.
+bool run_speculative_test() {
+
+	_osr r{};
+	r.resize(4096);
+
+	u64 seed{ 88172645463325252ull };
+
+	const auto random = [&]() {
+		seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+		return seed;
+	};
+
+	int x{ 64 }, y{ 48 };
+
+	for (size_t i{}; i < r.size(); ++i) {
+
+		x = std::clamp(x + int(random() % 5) - 2, 0, 128);
+		y = std::clamp(y + int(random() % 5) - 2, 0, 96);
+
+		r.delta[i] = 16 + (i % 3 != 0);
+		r.x[i] = float(x * 4);
+		r.y[i] = float(y * 4);
+		r.keys[i] = (i % 256) < 4;
+
+	}
+
+	rrf_encode_options options{};
+	options.speculative = 1;
+
+	std::vector<u8> file{};
+	encode_replay(file, r, 0, {}, options);
+
+	const auto strategy{ DIAG::strategy };
+
+	_osr decoded{};
+
+	if (rrf_to_frames(file.data(), file.size(), decoded) == 0 || decoded.size() != r.size())
+		return 0;
+
+	float error{};
+
+	for (size_t i{}; i < r.size(); ++i)
+		error = std::max({ error, std::abs(decoded.x[i] - r.x[i]), std::abs(decoded.y[i] - r.y[i]) });
+
+	printf("strategy %u, %zu bytes, max error %f\n", unsigned(strategy), file.size(), error);
+
+	return strategy != rrf_strategy::rule && error <= 0.5f;
+}
+
 int main(const int param_count, char** param) {
 
 	//run_test_set(); return 0;
 
-	if (param_count != 3) {
+#ifndef _WIN32
+
+	if (param_count >= 3 && std::string_view(param[1]) == "--serve") {
+
+		const size_t workers{ param_count > 3 ? (size_t)atoi(param[3]) : (size_t)std::thread::hardware_concurrency() };
+		const size_t cache_mb{ param_count > 4 ? (size_t)atoi(param[4]) : 256 };
+
+		return rrf_server::_server{}.run(param[2], workers, cache_mb << 20);
+	}
+
+	if (param_count >= 4 && std::string_view(param[1]) == "--client") {
+
+		const size_t requests{ param_count > 4 ? (size_t)atoi(param[4]) : 1000 };
+		const size_t connections{ param_count > 5 ? (size_t)atoi(param[5]) : 4 };
+
+		return rrf_server::run_client(param[2], param[3], requests, connections, RRF_FLAG::has_osr_header);
+	}
+
+#endif
+
+	if (param_count >= 3 && std::string_view(param[1]) == "--test-corrupt")
+		return run_corrupt_test(param[2], param_count > 3 ? (size_t)atoi(param[3]) : 10000) ? 0 : 1;
+
+	if (param_count == 2 && std::string_view(param[1]) == "--test-speculative")
+		return run_speculative_test() ? 0 : 1;
+
+	if (param_count != 3 && param_count != 4) {
 	
-		puts("rrf.exe {input_path} {output_path}\n");
+		puts("rrf.exe {input_path} {output_path} [coarse|standard|native|lossless|{max_error}]\n");
+		puts("rrf.exe --test-corrupt {input_rrf} [rounds]\n");
+		puts("rrf.exe --test-speculative\n");
+#ifndef _WIN32
+		puts("rrf.exe --serve {socket_path} [workers] [cache_mb]\n");
+		puts("rrf.exe --client {socket_path} {input_path} [requests] [connections]\n");
+#endif
 
 		return 0;
 	}
 
 	if(std::string_view(param[1]).find(".osr") != std::string::npos) {
 
-		osr_to_rrf(param[1], param[2], RRF_FLAG::has_osr_header);
+		rrf_encode_options options{};
+
+		if (param_count == 4) {
+
+			const std::string_view q{ param[3] };
+
+			if (q == "coarse") options.quality = rrf_quality::coarse;
+			else if (q == "native") options.quality = rrf_quality::native;
+			else if (q == "lossless") options.quality = rrf_quality::lossless;
+			else if (q != "standard") {
+				options.quality = rrf_quality::max_error;
+				options.max_error = (float)atof(param[3]);
+			}
+
+		}
+
+		osr_to_rrf(param[1], param[2], RRF_FLAG::has_osr_header, options);
 		//printf("\n Final Compression Ratio: %f\n", float(DIAG::OUTPUT_SIZE) / float(DIAG::INPUT_SIZE));
 
 	}
@@ -23,26 +23,161 @@ struct _stream_map {
 
 		}
 
-		return {};
+		static const std::vector<u8> empty{};
+
+		return empty;
 	}
 
 };
 
 namespace rrf {
 
+	// LzmaDecode allocates and fills the probability tables on every call, this keeps them per thread.
+	// They are only reallocated when lc + lp grows, the dictionary is always the output buffer.
+	struct _lzma_decoder {
+
+		CLzmaDec state;
+
+		u32 lc_lp{};
+
+		_lzma_decoder() {
+			LzmaDec_Construct(&state);
+		}
+
+		_lzma_decoder(const _lzma_decoder&) = delete;
+		_lzma_decoder& operator=(const _lzma_decoder&) = delete;
+
+		~_lzma_decoder() {
+			LzmaDec_FreeProbs(&state, &lzma_allocFuncs);
+		}
+
+		// Same contract as LzmaDecode with LZMA_FINISH_END.
+		SRes decode(u8* output, size_t& output_size, const u8* src, size_t& src_size, const u8* props) {
+
+			const size_t out_size{ output_size }, in_size{ src_size };
+
+			output_size = src_size = 0;
+
+			CLzmaProps p{};
+
+			RINOK(LzmaProps_Decode(&p, props, LZMA_PROPS_SIZE));
+
+			if (state.probs == nullptr || p.lc + p.lp > lc_lp) {
+				RINOK(LzmaDec_AllocateProbs(&state, props, LZMA_PROPS_SIZE, &lzma_allocFuncs));
+				lc_lp = p.lc + p.lp;
+			}
+
+			state.prop = p;
+			state.dic = output;
+			state.dicBufSize = out_size;
+
+			ON_SCOPE_EXIT( state.dic = nullptr; );
+
+			LzmaDec_Init(&state);
+
+			ELzmaStatus status{};
+
+			src_size = in_size;
+
+			auto res{ LzmaDec_DecodeToDic(&state, out_size, src, &src_size, LZMA_FINISH_END, &status) };
+
+			output_size = state.dicPos;
+
+			if (res == SZ_OK && status == LZMA_STATUS_NEEDS_MORE_INPUT)
+				res = SZ_ERROR_INPUT_EOF;
+
+			return res;
+		}
+
+	};
+
+	thread_local _lzma_decoder decoder{};
+
+	// data is a u32 raw size, the props then the LZMA stream. Returns the decoded size, 0 on failure.
+	size_t lzma_decode(u8* output, const size_t output_size, const u8* data, const size_t size) {
+
+		if (size < 4 + LZMA_PROPS_SIZE || *(u32*)data != output_size)
+			return 0;
+
+		size_t decomp_size{ output_size };
+		size_t input_size{ size - (4 + LZMA_PROPS_SIZE) };
+
+		const auto rcode{ decoder.decode(output, decomp_size, data + LZMA_PROPS_SIZE + 4, input_size, data + 4) };
+
+		return rcode == SZ_OK ? decomp_size : 0;
+	}
+
+	// Split streams decode their blocks in parallel, each straight into its place in ret.
+	void lzma_decomp_split(std::vector<u8>& ret, const u8* data, const size_t size) {
+
+		ret.clear();
+
+		const size_t total{ *(u32*)data & ~LZMA_SPLIT };
+
+		if (size < 8 || total > RRF_MAX_STREAM_SIZE)
+			return;
+
+		const size_t count{ *(u32*)(data + 4) };
+
+		if (count == 0 || count > (size - 8) / 4)
+			return;
+
+		const u32* const block_size{ (const u32*)(data + 8) };
+
+		std::vector<size_t> input(count), output(count + 1);
+
+		for (size_t i{}, in{ 8 + count * 4 }; i < count; ++i) {
+
+			if (block_size[i] < 4 + LZMA_PROPS_SIZE || block_size[i] > size - in)
+				return;
+
+			input[i] = in;
+			output[i + 1] = output[i] + *(u32*)(data + in);
+
+			in += block_size[i];
+		}
+
+		if (output[count] != total)
+			return;
+
+		ret.resize(total);
+
+		std::atomic<bool> failed{};
+
+		parallel_for(count, [&](const size_t i) {
+
+			const size_t s{ output[i + 1] - output[i] };
+
+			if (lzma_decode(ret.data() + output[i], s, data + input[i], block_size[i]) != s)
+				failed = 1;
+
+		});
+
+		if (failed)
+			ret.clear();
+
+	}
+
 	void lzma_decomp(std::vector<u8>& ret, const u8* data, size_t size) {
 
+		ret.clear();
+
+		if (size < 4 + LZMA_PROPS_SIZE)
+			return;
+
+		if (*(u32*)data & LZMA_SPLIT)
+			return lzma_decomp_split(ret, data, size);
+
 		size_t decomp_size{ *(u32*)data };
 
+		if (decomp_size > RRF_MAX_STREAM_SIZE)
+			return;
+
 		ret.resize(decomp_size);
 
 		size_t input_size{ size - (4 + LZMA_PROPS_SIZE) };
-		ELzmaStatus lzma_status{};
 
-		const auto rcode{
-			LzmaDecode(ret.data(), &decomp_size, data + LZMA_PROPS_SIZE + 4, &input_size, data + 4,
-			LZMA_PROPS_SIZE, LZMA_FINISH_END, &lzma_status, &lzma_allocFuncs)
-		};
+		const auto rcode{ decoder.decode(ret.data(), decomp_size, data + LZMA_PROPS_SIZE + 4, input_size, data + 4) };
 
 		if (rcode != SZ_OK) {
 			ret.clear();
@@ -53,6 +188,38 @@ namespace rrf {
 
 	};
 
+	// compact_header::lzma_short, varint size and the props byte in front of the stream.
+	void lzma_decomp_short(std::vector<u8>& ret, const u8* data, const size_t size) {
+
+		ret.clear();
+
+		const u8* p{ data };
+		const u8* const end{ data + size };
+
+		u64 decomp_size;
+
+		if (compact_header::get_varint(p, end, decomp_size) == 0 || p == end || decomp_size > RRF_MAX_STREAM_SIZE)
+			return;
+
+		// Any dictionary at least as large as the output decodes the same.
+		const u32 dict{ std::max(u32(decomp_size), u32(1) << 12) };
+
+		u8 props[LZMA_PROPS_SIZE]{ *(p++) };
+		memcpy(props + 1, &dict, 4);
+
+		ret.resize(decomp_size);
+
+		size_t output_size{ ret.size() }, input_size{ size_t(end - p) };
+
+		if (decoder.decode(ret.data(), output_size, p, input_size, props) != SZ_OK) {
+			ret.clear();
+			return;
+		}
+
+		ret.resize(output_size);
+
+	}
+
 	std::vector<u8> read_chunk(const _data_chunk dc, u8*& data) {
 
 		std::vector<u8> ret{};
@@ -72,53 +239,53 @@ namespace rrf {
 
 }
 
-template<int stride = 2>
-void extract_exponent_stream(const u32 key_frame_count, floatp* output,
+void extract_exponent_stream(const u32 key_frame_count, u8* output,
 	const u8* absolute_table,
 	const bit_stream& stream_bit,
-	const bit_stream& sustain_bit,
-	std::vector<u32>& sustain) {
-
-	{
+	const bit_stream& sustain_bit) {
 
-		size_t bit_offset{};
-
-		for (auto& v : sustain)
-			v = read_bucket(sustain_bit, bit_offset, GAME_SPACE_EXP_SUSTAIN);
-
-	}
-
-	size_t bit_offset{};
+	size_t bit_offset{}, sustain_offset{};
 	u8 last_exponent{};
 	size_t exp_i{};
 
+	// Sustains are read as they are needed, a long one is just a memset.
+
+	const auto next_sustain = [&]() {
+		return read_bucket(sustain_bit, sustain_offset, GAME_SPACE_EXP_SUSTAIN);
+	};
+
 	const auto write_exponent = [&](u8 exp, u32 count) {
 
-		for (size_t i{}; i <= count; ++i)
-			output[stride * (exp_i++)].p.exponent = exp;
+		const size_t size{ std::min((size_t)count + 1, key_frame_count - exp_i) };
+
+		memset(output + exp_i, exp, size);
+		exp_i += size;
 
 		last_exponent = exp;
 
 	};
 
-	write_exponent(absolute_table[read_bucket<3>(stream_bit, bit_offset, 3)], 0);
+	// The table is 256 entries, anything past it is a damaged stream.
+	const auto absolute = [&]() {
+		return absolute_table[std::min<u32>(read_bucket<3>(stream_bit, bit_offset, 3), 255)];
+	};
+
+	write_exponent(absolute(), 0);
 
 	bool double_sign{};
 	bool IMPL_SIGN{};
 
-	for (size_t sustain_i{}; exp_i < key_frame_count; ) {
+	while (exp_i < key_frame_count) {
 
 		if (small_read<1>(stream_bit, bit_offset) == 1) {
 
-			const auto index{ read_bucket<3>(stream_bit, bit_offset, 3) };
-
-			write_exponent(absolute_table[index], sustain[sustain_i++]);
+			write_exponent(absolute(), next_sustain());
 			IMPL_SIGN = 0;
 
 		}
 		else {
 
-			auto current_sign{ IMPL_SIGN ? double_sign : stream_bit[bit_offset++] };
+			auto current_sign{ IMPL_SIGN ? double_sign : small_read<1>(stream_bit, bit_offset) != 0 };
 
 			const auto consume{
 				read_bucket(stream_bit, bit_offset, EXP_ICHUNK_CONSUME)
@@ -139,7 +306,7 @@ void extract_exponent_stream(const u32 key_frame_count, floatp* output,
 					if (current_sign) --base;
 					else ++base;
 
-					write_exponent(base, sustain[sustain_i++]);
+					write_exponent(base, next_sustain());
 
 				}
 
@@ -155,19 +322,77 @@ void extract_exponent_stream(const u32 key_frame_count, floatp* output,
 }
 
 
-template<int stride = 2>
+// Sign is already in the table, exponent and mantissa get merged in.
+void merge_float(floatp* float_table, const u8* exponent, const u16* low, const u8* high, const size_t count) {
+
+	u32* const w{ (u32*)float_table };
+
+	constexpr u32 SIGN_MASK{ 1u << 31 };
+	constexpr u32 MANTISSA_MASK{ (1u << 23) - 1 };
+
+	size_t i{};
+
+#ifdef RRF_SSE2
+
+	{
+
+		const __m128i zero{ _mm_setzero_si128() };
+		const __m128i sign_mask{ _mm_set1_epi32(SIGN_MASK) };
+		const __m128i mantissa_mask{ _mm_set1_epi32(MANTISSA_MASK) };
+
+		for (; i + 8 <= count; i += 8) {
+
+			const __m128i l{ _mm_loadu_si128((const __m128i*)(low + i)) };
+			const __m128i h{ _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(high + i)), zero) };
+			const __m128i e{ _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(exponent + i)), zero) };
+
+			const __m128i m[2]{
+				_mm_or_si128(_mm_unpacklo_epi16(l, zero), _mm_slli_epi32(_mm_unpacklo_epi16(h, zero), 16)),
+				_mm_or_si128(_mm_unpackhi_epi16(l, zero), _mm_slli_epi32(_mm_unpackhi_epi16(h, zero), 16))
+			};
+
+			const __m128i ex[2]{
+				_mm_slli_epi32(_mm_unpacklo_epi16(e, zero), 23),
+				_mm_slli_epi32(_mm_unpackhi_epi16(e, zero), 23)
+			};
+
+			for (size_t z{}; z < 2; ++z) {
+
+				__m128i* const dst{ (__m128i*)(w + i + 4 * z) };
+
+				const __m128i v{ _mm_or_si128(_mm_and_si128(_mm_loadu_si128(dst), sign_mask), ex[z]) };
+
+				_mm_storeu_si128(dst, _mm_or_si128(v, _mm_and_si128(m[z], mantissa_mask)));
+			}
+
+		}
+
+	}
+
+#endif
+
+	for (; i < count; ++i) {
+
+		u32& v{ w[i] };
+
+		v = (v & SIGN_MASK) | (u32(exponent[i]) << 23) | (((u32(high[i]) << 16) | low[i]) & MANTISSA_MASK);
+
+	}
+
+}
+
 void extract_high_float(const _stream_map& stream_data, const u32 index,
-	const u32 key_frame_count, const u32 sustain_length,
-	floatp* float_table) {
+	const u32 key_frame_count, floatp* float_table) {
 
-	float_table += index;
+	if (key_frame_count == 0)
+		return;
 
-	std::vector<u32> sustain_buffer{}; sustain_buffer.resize(sustain_length);
+	std::vector<u8> exponent(key_frame_count);
 
 	// Exponent
 	{
 
-		u8 absolute_table[256];
+		u8 absolute_table[256]{};
 
 		{
 
@@ -179,8 +404,7 @@ void extract_high_float(const _stream_map& stream_data, const u32 index,
 
 			*(v++) = read_bucket<3>(table_stream, i, 4) ^ 128;
 
-			for (;;) {
-
+			while (v < absolute_table + sizeof(absolute_table)) {
 
 				auto delta{ (int)read_bucket<3>(table_stream, i, 2) };
 
@@ -198,11 +422,10 @@ void extract_high_float(const _stream_map& stream_data, const u32 index,
 
 		}
 
-		extract_exponent_stream<stride>(key_frame_count, float_table,
+		extract_exponent_stream(key_frame_count, exponent.data(),
 			absolute_table,
 			bit_stream{ stream_data[rrf_tag(u8(rrf_tag::game_space_float_x_exponent_stream) + index)] },
-			bit_stream{ stream_data[rrf_tag(u8(rrf_tag::game_space_float_x_exponent_sustain) + index)] },
-			sustain_buffer
+			bit_stream{ stream_data[rrf_tag(u8(rrf_tag::game_space_float_x_exponent_sustain) + index)] }
 		);
 
 	}
@@ -210,75 +433,229 @@ void extract_high_float(const _stream_map& stream_data, const u32 index,
 	// Mantissa
 	{
 
-		const auto mantissa_buffer{ stream_data[rrf_tag(u8(rrf_tag::game_space_float_x_mantissa) + index)] };
-				
+		const auto& mantissa_buffer{ stream_data[rrf_tag(u8(rrf_tag::game_space_float_x_mantissa) + index)] };
+
 		const u8* d{ mantissa_buffer.data() };
+		const u8* const d_end{ d + mantissa_buffer.size() };
 
-		bit_stream d_buff{};
+		// Both planes are byte aligned deltas from the previous frame - the low 16 bits and the next 8.
 
-		constexpr size_t start[]{ 0, 16, 24 };
+		std::vector<u16> low(key_frame_count);
+		std::vector<u8> high(key_frame_count);
 
-		for (size_t mc{}; mc < 2; ++mc) {
+		std::vector<u8> plane{};
+
+		for (size_t mc{}; mc < 2 && d + 4 <= d_end; ++mc) {
 
 			auto size{ *(u32*)d };
 
-			if (size == 0) {
-				d += 4;
+			d += 4;
+
+			if (size == 0)
 				continue;
-			}
+
+			if ((size & ~((u32)1 << 31)) > size_t(d_end - d))
+				break;
+
+			u8* const dst{ mc == 0 ? (u8*)low.data() : high.data() };
+			const size_t dst_size{ mc == 0 ? low.size() * 2 : high.size() };
+
+			ON_SCOPE_EXIT( d += size; );
 
 			if (size & ((u32)1 << 31)) {
 				size <<= 1;
 				size >>= 1;
-				rrf::lzma_decomp(d_buff.data, d + 4, size);
+
+				// A plane that fills its buffer exactly decodes straight into it.
+				if (rrf::lzma_decode(dst, dst_size, d, size) == dst_size && dst_size)
+					continue;
+
+				memset(dst, 0, dst_size);
+
+				rrf::lzma_decomp(plane, d, size);
 			}
-			else {
-				d_buff.data.resize(size);
-				memcpy(d_buff.data.data(), d + 4, size);
+			else
+				plane.assign(d, d + size);
+
+			if (plane.size())
+				memcpy(dst, plane.data(), std::min(plane.size(), dst_size));
+
+		}
+
+		simd::prefix_sum(low.data(), low.size());
+		simd::prefix_sum(high.data(), high.size());
+
+		merge_float(float_table, exponent.data(), low.data(), high.data(), key_frame_count);
+
+	}
+
+}
+
+namespace osr_text {
+
+	struct _text {
+
+		char data[15];
+		u8 size;
+
+		void set(const char* end) {
+			size = u8(end - data);
+		}
+
+	};
+
+	constexpr size_t MAX_FLOAT_TEXT{ 15 };
+
+	// Shortest round trip text, same output as to_chars.
+	// Floats that print as fixed point with up to 4 decimals are written directly, that covers every value in game space
+	// that isn't raw input.
+
+	char* write_float(char* p, char* const end, const float v) {
+
+		constexpr float pow10f[]{ 1.f, 10.f, 100.f, 1000.f, 10000.f };
+
+		const float a{ fabsf(v) };
+
+		if (a >= 0.001f && a < 100000.f) {
+
+			for (u32 k{}; k < 5; ++k) {
+
+				const double scaled{ double(a) * double(pow10f[k]) }; // Exact
+				const double m{ floor(scaled + 0.5) };
+
+				if (m > double(1 << 24) || m - scaled == 0.5)
+					break;
+
+				u32 mantissa{ u32(m) };
+
+				if (float(mantissa) / pow10f[k] != a)
+					continue;
+
+				char digits[16];
+				char* d{ digits + sizeof(digits) };
+
+				for (u32 c{}; c < k; ++c, mantissa /= 10)
+					*(--d) = char('0' + mantissa % 10);
+
+				if (k)
+					*(--d) = '.';
+
+				do {
+					*(--d) = char('0' + mantissa % 10);
+					mantissa /= 10;
+				} while (mantissa);
+
+				if (std::signbit(v))
+					*(p++) = '-';
+
+				const size_t size{ size_t(digits + sizeof(digits) - d) };
+
+				memcpy(p, d, size);
+
+				return p + size;
 			}
 
-			u16 last16{};
-			u8 last8{};
+		}
+
+		return std::to_chars(p, end, v).ptr;
+	}
+
+	// Time deltas come out of a small table, keys are almost always a few bits and x/y are often constants in taiko and mania.
+
+	std::string write_frames(const _osr& R, const std::vector<int>& delta_table, const std::vector<u32>& delta_index) {
+
+		constexpr std::string_view end_frame{ ",-12345|0|0|0" };
+
+		std::vector<_text> delta_text(delta_table.size());
+
+		size_t max_delta{};
+
+		for (size_t i{}; i < delta_table.size(); ++i) {
+
+			auto& t{ delta_text[i] };
+
+			t.set(std::to_chars(t.data, t.data + sizeof(t.data), delta_table[i]).ptr);
+			max_delta = std::max(max_delta, (size_t)t.size);
+		}
+
+		static const auto key_text{ [] {
 
-			size_t di{};
-			for (size_t i{}; i < key_frame_count; ++i) {
+			std::array<_text, 256> r{};
 
-				u32 mantissa{};
+			for (size_t i{}; i < r.size(); ++i)
+				r[i].set(std::to_chars(r[i].data, r[i].data + sizeof(r[i].data), u32(i)).ptr);
 
-				for (size_t z{ start[mc] }; z < start[mc + 1]; ++z)
-					mantissa |= (u32(d_buff[di++]) << z);
+			return r;
+		}() };
 
-				float_table[stride * i].p.mantissa |= mantissa;
+		// Worst case per frame, trimmed at the end
+		constexpr size_t MAX_KEY_TEXT{ 10 };
 
-				if (mc == 1) {
+		std::string output;
+		output.resize(R.size() * (max_delta + 2 * MAX_FLOAT_TEXT + MAX_KEY_TEXT + 4) + end_frame.size());
 
-					mantissa = float_table[stride * i].p.mantissa;
+		char* p{ output.data() };
+		char* const end{ output.data() + output.size() };
 
-					u16 t16{ u16(mantissa) };
-					u8 t8{ u8(mantissa >> 16) };
+		struct _cache {
 
-					t8 += last8;
-					t16 += last16;
+			u32 bits{};
+			bool valid{};
+			_text text{};
 
-					last8 = t8;
-					last16 = t16;
+			char* write(char* p, const float v) {
 
-					float_table[stride * i].p.mantissa = (u32(t8) << 16) | u32(t16);
+				const u32 b{ std::bit_cast<u32>(v) };
 
+				if (b != bits || valid == 0) {
+					bits = b;
+					valid = 1;
+					text.set(write_float(text.data, text.data + sizeof(text.data), v));
 				}
 
+				memcpy(p, text.data, text.size);
+
+				return p + text.size;
 			}
 
-			d += size + 4;
-			d_buff.clear();
+		} cache[2]{};
+
+		for (size_t i{}; i < R.size(); ++i) {
+
+			if (i)
+				*(p++) = ',';
+
+			const auto& d{ delta_text[delta_index[i]] };
+
+			memcpy(p, d.data, d.size);
+			p += d.size;
+			*(p++) = '|';
+
+			p = cache[0].write(p, R.x[i]);
+			*(p++) = '|';
+
+			p = cache[1].write(p, R.y[i]);
+			*(p++) = '|';
+
+			const u32 keys{ R.keys[i] };
+
+			if (keys < key_text.size()) {
+				memcpy(p, key_text[keys].data, key_text[keys].size);
+				p += key_text[keys].size;
+			} else
+				p = std::to_chars(p, end, keys).ptr;
 
 		}
 
-	}
+		memcpy(p, end_frame.data(), end_frame.size());
+		p += end_frame.size();
 
-}
+		output.resize(size_t(p - output.data()));
 
+		return output;
+	}
 
+}
 
 std::vector<u8> compress_osr_string(std::string_view string) {
 
@@ -310,93 +687,66 @@ std::vector<u8> compress_osr_string(std::string_view string) {
 	return output;
 }
 
-void construct_screen_space(const _rrf_header* header, const _stream_map& stream_data , std::vector<_osr_frame>& R) {
+void construct_screen_space(const _rrf_header* header, const _stream_map& stream_data, _osr& R) {
+
+	const size_t frame_count{ header->frame_count };
+
+	aligned_vector<int> delta_table[2];
+
+	delta_table[0].resize(frame_count);
+	delta_table[1].resize(frame_count);
 
-	std::vector<int> delta_table[2];
-	
-	delta_table[0].resize(header->frame_count);
-	delta_table[1].resize(header->frame_count);
-	
 	{
 
-		const auto read_delta_stream = [](const bit_stream& stream, std::vector<int>& output) {
+		const auto read_delta_stream = [](const bit_stream& stream, aligned_vector<int>& output) {
 
 			size_t i{};
-	
+
 			for (auto& v : output)
 				v = read_bucket(stream, i, SCREEN_SPACE_DELTA);
-	
+
 		};
-	
 
 		read_delta_stream(bit_stream{ stream_data[rrf_tag::screen_space_x_delta] }, delta_table[0]);
 		read_delta_stream(bit_stream{ stream_data[rrf_tag::screen_space_y_delta] }, delta_table[1]);
 
 	}
-	
+
+	// Sign runs alternate between positive and negative, the first one being one shorter.
 	{
-	
+
 		const bit_stream sign_stream{ stream_data[rrf_tag::screen_space_sign_sustain] };
-	
-		const auto read_sign_stream = [](const bit_stream& stream, std::vector<int>& output, size_t& i) {
-	
-			size_t sign{};
-			int frame{ -1 };
-	
-			while (frame < int(output.size())) {
-	
-				const auto sustain{ 1 + read_bucket(stream, i, SCREEN_SPACE_SIGN_SUSTAIN) };
-	
-				if (sign) {
-	
-					for (size_t z{}; z < sustain; ++z) {
-	
-						output[frame] = -output[frame];
-						++frame;
-					}
-	
-				} else frame += sustain;
-	
-				sign = !sign;
-	
-			}
-	
-		};
-	
+
 		size_t i{};
-		read_sign_stream(sign_stream, delta_table[0], i);
-		read_sign_stream(sign_stream, delta_table[1], i);
-	
+
+		for (auto& d : delta_table) {
+
+			run_length::read(sign_stream, i, frame_count, [&](const size_t start, const size_t end) {
+				simd::negate(d.data() + start, end - start);
+			}, SCREEN_SPACE_SIGN_SUSTAIN);
+
+		}
+
 	}
-	
-	int PREV[2]{};
-	
+
 	const auto& d{ stream_data[rrf_tag::screen_space_info] };
 
 	const float screen_ratio{ std::max(d.size() == 4 ? *(float*)d.data() : 1.f, 1.f) };
 
-	//const float RR{ 1.f / header->screen_ratio };
-	
-	for (size_t i{}; i < header->frame_count; ++i) {
-		
-		float* O = &R[i].x;
-	
-		for (size_t z{}; z < 2; ++z) {
-	
-			int v{ PREV[z] + delta_table[z][i] };
-			PREV[z] = v;
-	
-			//O[z] = float(v) * RR;
-			O[z] = float(v) / screen_ratio;
-	
-		}
-	
+	float* const O[2]{ R.x.data(), R.y.data() };
+
+	for (size_t z{}; z < 2; ++z) {
+
+		simd::prefix_sum(delta_table[z].data(), frame_count);
+
+		simd::divide(delta_table[z].data(), O[z], frame_count, screen_ratio);
+
 	}
 
 }
 
 
-void construct_game_space(const _rrf_header* header, const _stream_map& stream_data, std::vector<_osr_frame>& R) {
+void construct_game_space(const _rrf_header* header, const _stream_map& stream_data, _osr& R) {
 
 	_game_space_info gsi{};
 
@@ -404,28 +754,57 @@ void construct_game_space(const _rrf_header* header, const _stream_map& stream_d
 
 		const auto& d{ stream_data[rrf_tag::game_space_info] };
 
-		if (d.size() != sizeof(gsi))
+		if (d.size() != sizeof(gsi) && d.size() != offsetof(_game_space_info, quality))
 			return;
 
-		memcpy(&gsi, d.data(), sizeof(gsi));
+		memcpy(&gsi, d.data(), d.size());
 
 	}
 
-	std::vector<floatp> float_table{};
+	if (gsi.lowfi_count > header->frame_count)
+		return;
+
+	std::vector<floatp> float_table[2]{};
 	// Construct float table
 	{
 
 		const auto key_frame_count{ header->frame_count - gsi.lowfi_count };
 
-		float_table.resize(2 * key_frame_count);
+		float_table[0].resize(key_frame_count);
+		float_table[1].resize(key_frame_count);
 
-		std::vector<u32> sustain_buffer;
+		_raw_lattice_info raw_info{};
+
+		if (const auto& d{ stream_data[rrf_tag::game_space_raw_info] }; d.size() == sizeof(raw_info))
+			memcpy(&raw_info, d.data(), sizeof(raw_info));
 
 		for (size_t fc{}; fc < 2; ++fc) {
 
+			if (raw_info.axis_mask & (1 << fc)) {
+
+				const bit_stream counts{ stream_data[rrf_tag(u8(rrf_tag::game_space_raw_x_delta) + fc)] };
+
+				float prev{};
+
+				for (size_t i{}, bit_offset{}; i < key_frame_count; ++i)
+					float_table[fc][i].f = prev = raw_lattice::read(counts, bit_offset, prev, raw_info.step[fc]);
+
+				continue;
+			}
+
 			// Sign
-			{
+			if (const bit_stream runs{ stream_data[rrf_tag(u8(rrf_tag::game_space_float_x_sign_runs) + fc)] }; runs.data.size()) {
+
+				size_t bit_offset{};
+
+				run_length::read_adaptive(runs, bit_offset, key_frame_count, [&](const size_t start, const size_t end) {
+					for (size_t z{ start }; z < end; ++z)
+						float_table[fc][z].p.sign = 1;
+				});
+
+			} else {
 
+				// Older files keep the run lengths as raw u32s.
 				const auto& raw{ stream_data[rrf_tag(u8(rrf_tag::game_space_float_x_sign) + fc)] };
 
 				const auto count{ raw.size() / 4 };
@@ -438,7 +817,7 @@ void construct_game_space(const _rrf_header* header, const _stream_map& stream_d
 
 				for (size_t sc{}; sc < count; ++sc) {
 
-					const auto v{ data[sc] };
+					const size_t v{ std::min<size_t>(data[sc], key_frame_count - i) };
 
 					ON_SCOPE_EXIT(current_sign = !current_sign; i += v; );
 
@@ -446,85 +825,202 @@ void construct_game_space(const _rrf_header* header, const _stream_map& stream_d
 						continue;
 
 					for (size_t z{}; z < v; ++z)
-						float_table[fc + 2 * (i + z)].p.sign = 1;
+						float_table[fc][i + z].p.sign = 1;
 				}
 
 			}
 
-			extract_high_float(stream_data, fc, key_frame_count, gsi.exp_sustain_count[fc], float_table.data());
+			extract_high_float(stream_data, fc, key_frame_count, float_table[fc].data());
 
 		}
 
 	}
 
-	std::vector<bool> lowf_sign[2];
+	const u32 lowfi_count{ gsi.lowfi_count };
 
-	// Set up lowf sign table
+	std::vector<int> lowf_delta[2];
+
+	// Lowfi deltas are decoded up front, each axis has its own cursor.
 	{
 
-		bit_stream lowf_sign_stream{ stream_data[rrf_tag::game_space_lowf_sign] };
+		bit_stream lowf_delta_stream{ stream_data[rrf_tag::game_space_lowf_delta] };
+
+		size_t bit_offset[2]{ 0, gsi.lowf_delta_y_start_bit };
+
+		for (size_t i{}; i < 2; ++i) {
+
+			lowf_delta[i].resize(lowfi_count);
+
+			for (auto& v : lowf_delta[i])
+				v = (int)read_bucket(lowf_delta_stream, bit_offset[i], 4, 4, 4, 8);
+
+		}
+
+	}
+
+	// Signs are run length coded, negative runs are applied straight to the deltas.
+	{
 
-		const auto MAX_BIT{ lowf_sign_stream.size() };
+		bit_stream lowf_sign_stream{ stream_data[rrf_tag::game_space_lowf_sign] };
 
 		for (size_t i{}, bit_offset{}; i < 2; ++i) {
 
-			lowf_sign[i].resize(gsi.lowfi_count);
+			int* const delta{ lowf_delta[i].data() };
+
+			run_length::read(lowf_sign_stream, bit_offset, lowfi_count, [&](const size_t start, const size_t end) {
+				simd::negate(delta + start, end - start);
+			}, GAME_SPACE_LOWFI_SIGN_SUSTAIN);
+
+		}
+	}
 
-			int COUNT{ -1 };
-			for (bool flag{}; COUNT < (int)gsi.lowfi_count && bit_offset < MAX_BIT; ) {
+	// Now we can start reconstructing the full stream, a run of key frames then a run of lowfi frames.
+	// Lowfi frames accumulate from the rounded position of the key frame before them.
 
-				const auto sustain = 1 + read_bucket(lowf_sign_stream, bit_offset, 4, 4, 4, 8);
+	const float lowf_r{ 1.f / gsi.lowfi_resolution };
 
-				if (flag) {
-					for (size_t z{}; z < sustain; ++z)
-						lowf_sign[i][COUNT + z] = 1;
-				}
+	const size_t frame_count{ header->frame_count };
+
+	const floatp* const key_x{ float_table[0].data() };
+	const floatp* const key_y{ float_table[1].data() };
+
+	const int* const lowf_x{ lowf_delta[0].data() };
+	const int* const lowf_y{ lowf_delta[1].data() };
+
+	const size_t key_frame_count{ float_table[0].size() };
+
+	// Kept unsigned so a damaged stream wraps instead of overflowing.
+	u32 R_X{}, R_Y{};
+
+	float* const x{ R.x.data() };
+	float* const y{ R.y.data() };
+	const u32* const keys{ R.keys.data() };
+
+	// Every frame is a key frame
+	const bool lossless{ (header->flags & RRF_FLAG::force_lossless) != 0 };
+
+	for (size_t i{}, h_i{}, lowf_i{}; i < frame_count;) {
+
+		const size_t run_start{ i };
+
+		for (; i < frame_count && (keys[i] != 0 || lossless) && h_i < key_frame_count; ++i, ++h_i) {
+			x[i] = key_x[h_i].f;
+			y[i] = key_y[h_i].f;
+		}
+
+		if (i != run_start) {
+			R_X = u32((int)::roundf(x[i - 1] * gsi.lowfi_resolution));
+			R_Y = u32((int)::roundf(y[i - 1] * gsi.lowfi_resolution));
+		}
+
+		for (; i < frame_count && keys[i] == 0 && lossless == 0 && lowf_i < lowfi_count; ++i, ++lowf_i) {
+			x[i] = float(int(R_X += lowf_x[lowf_i])) * lowf_r;
+			y[i] = float(int(R_Y += lowf_y[lowf_i])) * lowf_r;
+		}
+
+		if (i == run_start) [[unlikely]]
+			break;
+
+	}
+
+	if (header->flags & RRF_FLAG::lowfi_residual) {
+
+		bit_stream residual{ stream_data[rrf_tag::game_space_lowf_residual] };
+
+		// Loaded streams don't know their last partial byte.
+		const size_t MAX_BIT{ residual.max_size() };
+
+		float* const O[2]{ x, y };
+
+		for (size_t i{}, bit_offset{}; i < frame_count && bit_offset < MAX_BIT; ++i) {
+
+			if (keys[i] != 0 || lossless)
+				continue;
+
+			for (size_t z{}; z < 2; ++z) {
+
+				const u32 d{ read_bucket(residual, bit_offset, GAME_SPACE_LOWFI_RESIDUAL) };
+
+				const u32 o{ ordered_float(O[z][i]) };
+
+				O[z][i] = unordered_float(d == 0 ? o : small_read<1>(residual, bit_offset) ? o - d : o + d);
 
-				COUNT += sustain;
-				flag = !flag;
 			}
 
 		}
+
 	}
 
-	// Now we can start reconstructing the full stream.
+}
 
-	size_t lowfi_x_index{}, lowfi_y_index{ gsi.lowf_delta_y_start_bit };
 
-	bit_stream lowf_delta_stream{ stream_data[rrf_tag::game_space_lowf_delta] };
+void construct_mania_keys(const _rrf_header* header, const std::vector<u8>& data, _osr& R) {
 
-	const float lowf_r{ 1.f / gsi.lowfi_resolution };
+	const u32 chord_count{ *(u32*)data.data() }, mask_bytes{ std::clamp(u32(data[4]), 1u, 4u) };
+
+	const u8* p{ data.data() + 5 };
+	const u8* const end{ data.data() + data.size() };
 
-	int R_X{}, R_Y{};
+	if (chord_count > header->frame_count)
+		return;
 
-	for (size_t i{}, lowf_i{}; i < header->frame_count; ++i) {
+	const auto read_count = [&]() -> u32 {
 
-		auto& f{ R[i] };
+		if (p == end)
+			return 0;
 
-		if (f.keys != 0) {
+		if (*p != 255) [[likely]]
+			return *p++;
 
-			const auto h_i{ 2 * (i - lowf_i) };
+		u32 v{};
 
-			R[i].x = float_table[h_i].f;
-			R[i].y = float_table[h_i + 1].f;
+		if (end - p >= 5)
+			memcpy(&v, p + 1, 4);
 
-			// A lot of useless rounds
-			R_X = (int)::roundf(R[i].x * gsi.lowfi_resolution);
-			R_Y = (int)::roundf(R[i].y * gsi.lowfi_resolution);
+		p = std::min(p + 5, end);
 
+		return v;
+	};
+
+	std::vector<u32> frame(chord_count), mask(chord_count);
+
+	for (u64 i{}, f{}; i < chord_count; ++i) {
+		f += read_count();
+		frame[i] = (u32)std::min<u64>(f++, header->frame_count);
+	}
+
+	if (size_t(end - p) < chord_count)
+		return;
+
+	const u8* const code{ p };
+	p += chord_count;
+
+	mania_chord::_model model{};
+
+	for (u32 i{}; i < chord_count; ++i) {
+
+		const u32 c{ std::min<u32>(code[i], mania_chord::DEPTH) };
+
+		if (c != 0)
+			mask[i] = model.get(c);
+		else if (size_t(end - p) >= mask_bytes) {
+			memcpy(&mask[i], p, mask_bytes);
+			p += mask_bytes;
 		}
-		else {
 
-			auto _x{ (int)read_bucket(lowf_delta_stream, lowfi_x_index, 4, 4, 4, 8) };
-			auto _y{ (int)read_bucket(lowf_delta_stream, lowfi_y_index, 4, 4, 4, 8) };
+		model.update(mask[i], c);
 
-			_x = lowf_sign[0][lowf_i] ? -_x : _x;
-			_y = lowf_sign[1][lowf_i] ? -_y : _y;
+	}
+
+	for (u32 i{}; i < chord_count; ++i) {
 
-			R[i].x = float(R_X += _x) * lowf_r;
-			R[i].y = float(R_Y += _y) * lowf_r;
+		for (u32 m{ mask[i] }; m; m &= m - 1) {
 
-			++lowf_i;
+			const u32 bit{ m & (0 - m) };
+			const u32 last{ (u32)std::min<u64>(u64(frame[i]) + read_count() + 1, header->frame_count) };
+
+			for (u32 f{ frame[i] }; f < last; ++f)
+				R.keys[f] |= bit;
 
 		}
 
@@ -532,45 +1028,135 @@ void construct_game_space(const _rrf_header* header, const _stream_map& stream_d
 
 }
 
-
-void construct_ctb(const _rrf_header* header, const _stream_map& stream_data, std::vector<_osr_frame>& R) {
+void construct_ctb(const _rrf_header* header, const _stream_map& stream_data, _osr& R) {
 
 	const auto& exp_raw{ stream_data[rrf_tag::fruits_exp_sustain] };
 
 	if (exp_raw.size() != 4)
 		return;
 
-	extract_high_float<4>(stream_data, 0, header->frame_count, *(u32*)exp_raw.data(), (floatp*)&R[0].x);
+	extract_high_float(stream_data, 0, header->frame_count, (floatp*)R.x.data());
 
 }
 
-bool rrf_to_osr(const char* input_file, const char* output_file) {
+// Everything short of the text.
+struct _rrf_frames {
 
-	const auto& raw_bytes{ read_file(input_file) };
+	_rrf_header header;
 
-	const _rrf_header*const header{ (const _rrf_header*)raw_bytes.data() };
+	_stream_map stream_data;
 
-	_stream_map stream_data{};
-	stream_data.data.resize(header->data_count);
+	_osr R;
 
-	{
+	// The text is written through a table of the distinct deltas.
+	std::vector<int> delta_table;
+	std::vector<u32> delta_index;
+
+};
+
+bool decode_frames(const u8* const raw_data, const size_t raw_size, _rrf_frames& frames) {
+
+	if (raw_size == 0)
+		return 0;
+
+	const _rrf_header* const header{ &frames.header };
+
+	auto& stream_data{ frames.stream_data };
+
+	const auto add_block = [&](const u8 tag, const compact_header::kind k, const u8* data, const size_t size) {
+
+		auto& o{ stream_data.data.emplace_back() };
+
+		o.tag = tag;
+
+		switch (k) {
+
+		case compact_header::raw:
+			add_to_u8(o.data, data, size);
+			return 1;
+
+		case compact_header::lzma:
+
+			if (size < 4 + LZMA_PROPS_SIZE)
+				return 0;
+
+			rrf::lzma_decomp(o.data, data, size);
+			return 1;
 
-		const u8* const tags{ raw_bytes.data() + sizeof(_rrf_header) };
+		case compact_header::lzma_short:
+			rrf::lzma_decomp_short(o.data, data, size);
+			return 1;
+
+		}
+
+		return 0;
+	};
+
+	if (raw_data[0] & 0x80) {
+
+		using namespace compact_header;
+
+		if (raw_data[0] != MARKER)
+			return 0;
+
+		const u8* p{ raw_data + 1 };
+		const u8* const end{ raw_data + raw_size };
+
+		u64 flags, frame_count, mask;
+
+		if (get_varint(p, end, flags) == 0 || get_varint(p, end, frame_count) == 0 || get_varint(p, end, mask) == 0 ||
+			flags > UINT32_MAX || frame_count > UINT32_MAX)
+			return 0;
+
+		const auto tags{ order(get_gamemode(u32(flags))) };
+
+		if (tags.size() < 64 && (mask >> tags.size()))
+			return 0;
+
+		frames.header = { RRF_VERSION, u32(flags), u32(frame_count), u32(std::popcount(mask)) };
+
+		u64 block[64];
+
+		for (size_t i{}; i < header->data_count; ++i) {
+			if (get_varint(p, end, block[i]) == 0)
+				return 0;
+		}
+
+		for (size_t pos{}, i{}; pos < tags.size(); ++pos) {
+
+			if ((mask >> pos & 1) == 0)
+				continue;
+
+			const u64 size{ block[i++] >> 2 };
+
+			if (size > u64(end - p) || add_block(u8(tags[pos]), kind(block[i - 1] & 3), p, size_t(size)) == 0)
+				return 0;
+
+			p += size;
+		}
+
+	} else {
+
+		if (raw_size < sizeof(_rrf_header))
+			return 0;
+
+		memcpy(&frames.header, raw_data, sizeof(_rrf_header));
+
+		if (header->data_count > 256 || sizeof(_rrf_header) + header->data_count * (1 + sizeof(_rrf_data_block)) > raw_size)
+			return 0;
+
+		const u8* const tags{ raw_data + sizeof(_rrf_header) };
 		const _rrf_data_block* const data_block{ (_rrf_data_block*)(tags + header->data_count) };
 
-		u8* data_ptr{ (u8*)(data_block + header->data_count) };
+		const u8* data_ptr{ (const u8*)(data_block + header->data_count) };
 
 		for (size_t i{}, size{ header->data_count }; i < size; ++i) {
-						
-			auto& o{ stream_data.data[i] };
+
 			const auto& db{ data_block[i] };
 
-			o.tag = tags[i];
-
-			if (db.is_compressed == 0)
-				add_to_u8(o.data, data_ptr, db.size);
-			else
-				rrf::lzma_decomp(o.data, data_ptr, db.size);
+			if (db.size > size_t(raw_data + raw_size - data_ptr) ||
+				add_block(tags[i], db.is_compressed ? compact_header::lzma : compact_header::raw, data_ptr, db.size) == 0)
+				return 0;
 
 			data_ptr += db.size;
 
@@ -578,61 +1164,97 @@ bool rrf_to_osr(const char* input_file, const char* output_file) {
 
 	}
 
-	std::vector<_osr_frame> R; R.resize(header->frame_count);
+	if (header->frame_count > RRF_MAX_FRAME_COUNT)
+		return 0;
+
+	auto& R{ frames.R }; R.resize(header->frame_count);
+
+	auto& delta_table{ frames.delta_table };
+	auto& delta_index{ frames.delta_index };
+	delta_index.resize(header->frame_count);
 
 	// Delta Time
 	{ 
 	
-		std::vector<int> delta_table{};
-	
 		{
 			size_t bit_offset{};
 
 			bit_stream bs{ stream_data[rrf_tag::time_delta_table] };
 
-			delta_table.resize(small_read<5>(bs, bit_offset));
+			const u32 count{ small_read<5>(bs, bit_offset) };
+
+			// Every entry takes at least 6 bits.
+			if (count > bs.max_size())
+				return 0;
+
+			delta_table.resize(count);
 	
 			for (auto& v : delta_table) v = small_read<5>(bs, bit_offset);
 			for (auto& v : delta_table) v = small_read<1>(bs, bit_offset) ? -v : v;
 	
 		}
 
-		{
-			size_t bit_offset{};
-			bit_stream bs{ stream_data[rrf_tag::time_delta_stream] };
-			
-			for (auto& v : R)
-				v.delta = delta_table[read_bucket(bs, bit_offset, BUCKET_TIME_STREAM)];
+		size_t bit_offset{};
+		bit_stream bs{ stream_data[rrf_tag::time_delta_stream] };
+
+		if (const auto& model{ stream_data[rrf_tag::time_delta_model] }; model.size() >= 8) {
+
+			u32 info[2];
+			memcpy(info, model.data(), sizeof(info));
+
+			_time_cadence c{ std::clamp(info[0], 1u, 1u << 16), std::max(info[1], 1u) };
+
+			for (size_t i{}; i < R.size(); ++i) {
+
+				const u32 index{ read_bucket(bs, bit_offset, BUCKET_TIME_STREAM) };
+
+				R.delta[i] = int(u32(index < delta_table.size() ? delta_table[index] : 0) + u32(c.predict()));
+
+				c.update(R.delta[i]);
+			}
+
+			// The text is written from a table of the final deltas.
+			delta_table.assign(R.delta.begin(), R.delta.end());
+
+			std::sort(delta_table.begin(), delta_table.end());
+			delta_table.erase(std::unique(delta_table.begin(), delta_table.end()), delta_table.end());
+
+			for (size_t i{}; i < R.size(); ++i)
+				delta_index[i] = u32(std::lower_bound(delta_table.begin(), delta_table.end(), R.delta[i]) - delta_table.begin());
+
+		} else {
+
+			for (size_t i{}; i < R.size(); ++i) {
+
+				const u32 index{ read_bucket(bs, bit_offset, BUCKET_TIME_STREAM) };
+
+				if (index >= delta_table.size())
+					return 0;
+
+				R.delta[i] = delta_table[delta_index[i] = index];
+			}
+
 		}
 	
 	}
 
 	// Keys
-	{
+	if (const auto& chord{ stream_data[rrf_tag::mania_key_chord] }; chord.size() >= 5)
+		construct_mania_keys(header, chord, R);
+	else {
 		size_t bit_offset{32};
 	
 		bit_stream bs{ stream_data[rrf_tag::key_bit_stream] };
 
-		const u32 flags{ bs.size() >= 4 ? *(u32*)bs.data.data() : 0 };
+		const u32 flags{ bs.data.size() >= 4 ? *(u32*)bs.data.data() : 0 };
+
+		const auto read_key = [&](const u32 flag_bits) {
+
+			run_length::read(bs, bit_offset, R.size(), [&](const size_t start, const size_t end) {
+				for (size_t i{ start }; i < end; ++i)
+					R.keys[i] |= flag_bits;
+			}, BUCKET_COMP_KEYS);
 
-		const auto read_key = [&](u32 flag_bits) {
-	
-			int COUNT{ -1 };
-			for (bool flag{}; COUNT < (int)header->frame_count && bit_offset < bs.size(); ) {
-	
-				const auto sustain{
-					1 + read_bucket(bs, bit_offset, BUCKET_COMP_KEYS)
-				};
-	
-				if (flag) {
-					for (size_t i{}; i < sustain; ++i)
-						R[COUNT + i].keys |= flag_bits;
-				}
-	
-				COUNT += sustain;
-				flag = !flag;
-			}
-	
 		};
 
 
@@ -658,16 +1280,20 @@ bool rrf_to_osr(const char* input_file, const char* output_file) {
 	}
 	if (header->flags & RRF_FLAG::gamemode_mania) {
 
-		const float speed{ *(float*)stream_data[rrf_tag::mania_scroll_data].data() };
+		const auto& scroll{ stream_data[rrf_tag::mania_scroll_data] };
+
+		const float speed{ scroll.size() >= 4 ? *(float*)scroll.data() : 0.f };
 
-		for (auto& r : R) {
-			r.x = float(r.keys >> 2);
-			r.y = speed;
-			r.keys &= 3;
+		for (size_t i{}; i < R.size(); ++i) {
+			R.x[i] = float(R.keys[i] >> 2);
+			R.y[i] = speed;
+			R.keys[i] &= 3;
 		}
 
-		R[0].x = 256.f; R[0].y = -500.f;
-		R[1].x = 256.f; R[1].y = -500.f;
+		if (R.size() > 1) {
+			R.x[0] = 256.f; R.y[0] = -500.f;
+			R.x[1] = 256.f; R.y[1] = -500.f;
+		}
 
 	}else if (header->flags & RRF_FLAG::gamemode_taiko) {
 	} else if (header->flags & RRF_FLAG::gamemode_fruits) {
@@ -675,59 +1301,90 @@ bool rrf_to_osr(const char* input_file, const char* output_file) {
 	}else
 		((header->flags & RRF_FLAG::using_screenspace) ? construct_screen_space : construct_game_space)(header, stream_data, R);
 
-	{
+	return 1;
+}
 
-		size_t i{};
-		std::string OUTPUT; OUTPUT.resize(4096);
-	
-		for (auto& r : R) {
+bool rrf_to_frames(const u8* const raw_data, const size_t raw_size, _osr& output) {
 
-			constexpr auto M_C{ 25 * 4 };
-	
-			if ((OUTPUT.size() - i) < M_C)
-				OUTPUT.resize(OUTPUT.size() + 4096);
-	
-			i = std::to_chars(OUTPUT.data() + i, OUTPUT.data() + OUTPUT.size(), r.delta).ptr - OUTPUT.data();
-			OUTPUT[i++] = '|';
-	
-			i = std::to_chars(OUTPUT.data() + i, OUTPUT.data() + OUTPUT.size(), r.x).ptr - OUTPUT.data();
-			OUTPUT[i++] = '|';
-	
-			i = std::to_chars(OUTPUT.data() + i, OUTPUT.data() + OUTPUT.size(), r.y).ptr - OUTPUT.data();
-			OUTPUT[i++] = '|';
-	
-			i = std::to_chars(OUTPUT.data() + i, OUTPUT.data() + OUTPUT.size(), r.keys).ptr - OUTPUT.data();
-			OUTPUT[i++] = ',';
-	
-		}
-	
-		OUTPUT.resize(std::max(i, (size_t)1) - 1);
-	
-		{
-			OUTPUT += ",-12345|0|0|0";
-		}
+	_rrf_frames frames{};
+
+	if (decode_frames(raw_data, raw_size, frames) == 0)
+		return 0;
+
+	output = std::move(frames.R);
+
+	return 1;
+}
+
+bool rrf_to_osr(const u8* const raw_data, const size_t raw_size, std::vector<u8>& final_file_output) {
+
+	final_file_output.clear();
+
+	_rrf_frames frames{};
+
+	if (decode_frames(raw_data, raw_size, frames) == 0)
+		return 0;
+
+	const auto& [header, stream_data, R, delta_table, delta_index] { frames };
+
+	{
+
+		const auto OUTPUT{ osr_text::write_frames(R, delta_table, delta_index) };
 	
 		const auto& compressed_string{ compress_osr_string(OUTPUT) };
-	
-		std::vector<u8> final_file_output{};
 
-		if (header->flags & RRF_FLAG::has_osr_header) {
+		if (header.flags & RRF_FLAG::has_osr_header) {
+
+			const auto& osr_header{ stream_data[rrf_tag::osr_header] };
 
-			add_to_u8(final_file_output, stream_data[rrf_tag::osr_header]);
+			if ((header.flags & RRF_FLAG::keep_life_bar) && osr_header.size() >= 8) {
+
+				// The life bar sits right before the time stamp
+				add_to_u8(final_file_output, osr_header.data(), osr_header.size() - 8);
+				add_to_u8(final_file_output, life_bar::decode(bit_stream{ stream_data[rrf_tag::life_bar] }));
+				add_to_u8(final_file_output, osr_header.data() + osr_header.size() - 8, 8);
+
+			} else
+				add_to_u8(final_file_output, osr_header);
 
 			add_to_u8(final_file_output, compressed_string.size());
 		}
 		
 		add_to_u8(final_file_output, compressed_string);
 	
-		if (header->flags & RRF_FLAG::has_osr_header) {
+		if (header.flags & RRF_FLAG::has_osr_header) {
 			add_to_u8(final_file_output, 0);// score id
 			add_to_u8(final_file_output, 0);
 		}
 	
-		write_file(output_file, final_file_output);
-	
 	}
 
 	return 1;
+}
+
+// For many small replays at once. Every worker takes replays until none are left, so its LZMA tables stay warm from one to the next.
+// A replay that fails leaves its output empty, returns how many were decoded.
+size_t rrf_to_osr_batch(const std::vector<std::vector<u8>>& input, std::vector<std::vector<u8>>& output) {
+
+	output.resize(input.size());
+
+	std::atomic<size_t> decoded{};
+
+	parallel_for(input.size(), [&](const size_t i) {
+		decoded += rrf_to_osr(input[i].data(), input[i].size(), output[i]);
+	});
+
+	return decoded;
+}
+
+bool rrf_to_osr(const char* input_file, const char* output_file) {
+
+	const auto& raw_bytes{ read_file(input_file) };
+
+	std::vector<u8> output{};
+
+	if (rrf_to_osr(raw_bytes.data(), raw_bytes.size(), output) == 0)
+		return 0;
+
+	return write_file(output_file, output);
 }
\ No newline at end of file
@@ -0,0 +1,669 @@
+#pragma once
+
+#include "rrf_write.h"
+#include "rrf_read.h"
+
+// Long running transcoder for serving downloads.
+// Requests come in over a unix domain socket, decoded replays are kept in a byte bounded LRU cache keyed by the rrf contents.
+// The hash only picks the entry, a hit is the stored rrf comparing equal to the request.
+// Idle connections sit in a poll set, a worker only takes one for a single request and then hands it back.
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <deque>
+#include <unordered_map>
+
+namespace rrf_server {
+
+	enum class op : u8 {
+		encode = 'E', // osr -> rrf, flags are passed straight to osr_to_rrf
+		decode = 'D', // rrf -> osr
+		stats = 'S', // Returns the counters as text
+	};
+
+	enum status : u32 {
+		ok,
+		failed,
+	};
+
+	struct _request {
+		u8 op, pad[3];
+		u32 flags, size;
+	};
+
+	struct _response {
+		u32 status, size;
+	};
+
+	// Marathon replays stay well under this as osr or rrf.
+	constexpr u32 MAX_REQUEST_SIZE{ 1 << 25 };
+
+	// A client gets this long to send a whole request, and again to take the whole response.
+	constexpr std::chrono::seconds IO_DEADLINE{ 10 };
+
+	// Buffers that grew past this for one request are freed afterwards instead of staying with the worker.
+	constexpr size_t KEEP_BUFFER_SIZE{ 1 << 22 };
+
+	using io_clock = std::chrono::steady_clock;
+
+	u64 hash_bytes(const u8* data, size_t size) {
+
+		constexpr u64 prime{ 0x9e3779b97f4a7c15ull };
+
+		u64 h{ size * prime };
+
+		for (; size >= 8; size -= 8, data += 8) {
+
+			u64 w;
+			memcpy(&w, data, 8);
+
+			h = std::rotl((h ^ w) * prime, 31);
+		}
+
+		u64 w{};
+		memcpy(&w, data, size);
+
+		h = (h ^ w) * prime;
+
+		return h ^ (h >> 29);
+	}
+
+	struct _cache {
+
+		struct _key {
+
+			u64 hash;
+			size_t size;
+
+			bool operator==(const _key& k) const {
+				return hash == k.hash && size == k.size;
+			}
+
+		};
+
+		struct _key_hash {
+			size_t operator()(const _key& k) const {
+				return size_t(k.hash);
+			}
+		};
+
+		struct _entry {
+
+			_key key;
+			std::vector<u8> input, data;
+
+			size_t bytes() const {
+				return input.size() + data.size();
+			}
+
+		};
+
+		std::mutex lock;
+
+		std::list<_entry> entry; // Front is the most recently used
+		std::unordered_map<_key, std::list<_entry>::iterator, _key_hash> map;
+
+		size_t bytes{}, max_bytes{};
+
+		bool get(const _key& key, const std::vector<u8>& input, std::vector<u8>& output) {
+
+			std::lock_guard<std::mutex> l{ lock };
+
+			const auto it{ map.find(key) };
+
+			if (it == map.end() || it->second->input != input)
+				return 0;
+
+			entry.splice(entry.begin(), entry, it->second);
+
+			output = it->second->data;
+
+			return 1;
+		}
+
+		void put(const _key& key, const std::vector<u8>& input, const std::vector<u8>& data) {
+
+			const size_t size{ input.size() + data.size() };
+
+			if (size > max_bytes)
+				return;
+
+			std::lock_guard<std::mutex> l{ lock };
+
+			// A colliding entry stays, the newer input just misses every time.
+			if (map.find(key) != map.end())
+				return;
+
+			while (bytes + size > max_bytes && entry.size()) {
+
+				bytes -= entry.back().bytes();
+				map.erase(entry.back().key);
+				entry.pop_back();
+
+			}
+
+			entry.push_front({ key, input, data });
+			map[key] = entry.begin();
+
+			bytes += size;
+
+		}
+
+	};
+
+	struct _counters {
+
+		struct _op {
+
+			std::atomic<u64> count{}, errors{}, total_us{}, max_us{};
+
+			void add(const u64 us, const bool success) {
+
+				++count;
+				errors += success == 0;
+				total_us += us;
+
+				for (u64 m{ max_us }; us > m && max_us.compare_exchange_weak(m, us) == 0;);
+
+			}
+
+			std::string format(const char* name) const {
+
+				char b[256];
+
+				const u64 c{ count };
+
+				snprintf(b, sizeof(b), "%s count=%llu errors=%llu avg_us=%.1f max_us=%llu\n", name,
+					(unsigned long long)c, (unsigned long long)errors.load(),
+					c ? double(total_us) / double(c) : 0.0, (unsigned long long)max_us.load());
+
+				return b;
+			}
+
+		};
+
+		_op encode, decode;
+
+		std::atomic<u64> cache_hit{}, cache_miss{};
+
+	};
+
+	// Waits until fd is ready for events, false once the deadline has passed. The maximum time point never expires.
+	bool wait_ready(const int fd, const short events, const io_clock::time_point deadline) {
+
+		if (deadline == io_clock::time_point::max())
+			return 1;
+
+		for (;;) {
+
+			const auto left{ std::chrono::duration_cast<std::chrono::milliseconds>(deadline - io_clock::now()).count() };
+
+			if (left <= 0)
+				return 0;
+
+			pollfd p{ fd, events, 0 };
+
+			const int r{ ::poll(&p, 1, int(std::min<long long>(left, INT_MAX))) };
+
+			if (r < 0 && errno == EINTR)
+				continue;
+
+			return r > 0;
+		}
+
+	}
+
+	bool read_all(const int fd, void* dst, size_t size, const io_clock::time_point deadline = io_clock::time_point::max()) {
+
+		for (u8* p{ (u8*)dst }; size;) {
+
+			if (wait_ready(fd, POLLIN, deadline) == 0)
+				return 0;
+
+			const auto r{ ::read(fd, p, size) };
+
+			if (r < 0 && errno == EINTR)
+				continue;
+
+			if (r <= 0)
+				return 0;
+
+			p += r;
+			size -= size_t(r);
+		}
+
+		return 1;
+	}
+
+	bool write_all(const int fd, const void* src, size_t size, const io_clock::time_point deadline = io_clock::time_point::max()) {
+
+		const int flags{ MSG_NOSIGNAL | (deadline != io_clock::time_point::max() ? MSG_DONTWAIT : 0) };
+
+		for (const u8* p{ (const u8*)src }; size;) {
+
+			if (wait_ready(fd, POLLOUT, deadline) == 0)
+				return 0;
+
+			const auto r{ ::send(fd, p, size, flags) };
+
+			if (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+				continue;
+
+			if (r <= 0)
+				return 0;
+
+			p += r;
+			size -= size_t(r);
+		}
+
+		return 1;
+	}
+
+	int open_socket(const char* path, const bool listen_socket) {
+
+		sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+
+		if (strlen(path) >= sizeof(addr.sun_path))
+			return -1;
+
+		strcpy(addr.sun_path, path);
+
+		const int fd{ ::socket(AF_UNIX, SOCK_STREAM, 0) };
+
+		if (fd < 0)
+			return -1;
+
+		if (listen_socket) {
+
+			::unlink(path);
+
+			if (::bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0 && ::listen(fd, 128) == 0)
+				return fd;
+
+		} else if (::connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0)
+			return fd;
+
+		::close(fd);
+		return -1;
+	}
+
+	struct _server {
+
+		_cache cache;
+		_counters counters;
+
+		// Connections with a request ready to be read.
+		std::mutex queue_lock;
+		std::condition_variable queue_signal;
+		std::deque<int> queue;
+
+		// Connections a worker finished with, the poll loop takes them back when woken through the pipe.
+		std::mutex idle_lock;
+		std::vector<int> idle;
+		int wake_fd[2]{ -1, -1 };
+
+		std::string stats() {
+
+			const u64 hit{ counters.cache_hit }, miss{ counters.cache_miss };
+
+			size_t bytes{}, entries{};
+
+			{
+				std::lock_guard<std::mutex> l{ cache.lock };
+				bytes = cache.bytes;
+				entries = cache.entry.size();
+			}
+
+			char b[256];
+
+			snprintf(b, sizeof(b), "cache hit=%llu miss=%llu hit_rate=%.4f entries=%zu bytes=%zu max_bytes=%zu\n",
+				(unsigned long long)hit, (unsigned long long)miss, (hit + miss) ? double(hit) / double(hit + miss) : 0.0,
+				entries, bytes, cache.max_bytes);
+
+			return b + counters.encode.format("encode") + counters.decode.format("decode");
+		}
+
+		bool handle(const _request& request, const std::vector<u8>& input, std::vector<u8>& output) {
+
+			switch (op(request.op)) {
+
+			case op::encode:
+				return osr_to_rrf(input.data(), input.size(), request.flags, output);
+
+			case op::decode: {
+
+				const _cache::_key key{ hash_bytes(input.data(), input.size()), input.size() };
+
+				if (cache.get(key, input, output)) {
+					++counters.cache_hit;
+					return 1;
+				}
+
+				++counters.cache_miss;
+
+				if (rrf_to_osr(input.data(), input.size(), output) == 0)
+					return 0;
+
+				cache.put(key, input, output);
+
+				return 1;
+			}
+
+			case op::stats: {
+
+				const auto s{ stats() };
+
+				output.assign(s.begin(), s.end());
+
+				return 1;
+			}
+
+			}
+
+			return 0;
+		}
+
+		// Answers one request, false when the connection should be closed.
+		bool serve_request(const int fd, std::vector<u8>& input, std::vector<u8>& output) {
+
+			_request request{};
+
+			const auto deadline{ io_clock::now() + IO_DEADLINE };
+
+			if (read_all(fd, &request, sizeof(request), deadline) == 0 || request.size > MAX_REQUEST_SIZE)
+				return 0;
+
+			// Grows with what has arrived, a header alone can't make the worker allocate the full size.
+			input.clear();
+
+			while (input.size() < request.size) {
+
+				const size_t have{ input.size() };
+				const size_t chunk{ std::min<size_t>(request.size - have, std::max<size_t>(have, 1 << 16)) };
+
+				input.resize(have + chunk);
+
+				if (read_all(fd, input.data() + have, chunk, deadline) == 0)
+					return 0;
+			}
+
+			const auto start{ std::chrono::steady_clock::now() };
+
+			bool success{};
+
+			try {
+				success = handle(request, input, output);
+			} catch (...) {
+				success = 0;
+			}
+
+			const u64 us{ (u64)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() };
+
+			if (op(request.op) == op::encode)
+				counters.encode.add(us, success);
+			else if (op(request.op) == op::decode)
+				counters.decode.add(us, success);
+
+			if (success == 0)
+				output.clear();
+
+			const _response response{ success ? status::ok : status::failed, (u32)output.size() };
+
+			const auto write_deadline{ io_clock::now() + IO_DEADLINE };
+
+			return write_all(fd, &response, sizeof(response), write_deadline) && write_all(fd, output.data(), output.size(), write_deadline);
+		}
+
+		void worker() {
+
+			// There is a worker per core already, split streams decode on this thread.
+			parallel_inline = 1;
+
+			std::vector<u8> input{}, output{};
+
+			for (;;) {
+
+				int fd{};
+
+				{
+					std::unique_lock<std::mutex> l{ queue_lock };
+
+					queue_signal.wait(l, [&] { return queue.size() != 0; });
+
+					fd = queue.front();
+					queue.pop_front();
+				}
+
+				const bool keep{ serve_request(fd, input, output) };
+
+				for (auto* b : { &input, &output })
+					if (b->capacity() > KEEP_BUFFER_SIZE)
+						std::vector<u8>{}.swap(*b);
+
+				if (keep == 0) {
+					::close(fd);
+					continue;
+				}
+
+				{
+					std::lock_guard<std::mutex> l{ idle_lock };
+					idle.push_back(fd);
+				}
+
+				const u8 wake{};
+				(void)!::write(wake_fd[1], &wake, 1);
+
+			}
+
+		}
+
+		int run(const char* socket_path, size_t worker_count, const size_t cache_bytes) {
+
+			cache.max_bytes = cache_bytes;
+
+			const int listen_fd{ open_socket(socket_path, 1) };
+
+			if (listen_fd < 0 || ::pipe(wake_fd) != 0) {
+				printf("Failed to listen on %s\n", socket_path);
+				return 0;
+			}
+
+			// A full pipe already has the poll loop awake.
+			for (const int fd : wake_fd)
+				::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+			worker_count = std::max(worker_count, (size_t)1);
+
+			std::vector<std::thread> workers{};
+
+			for (size_t i{}; i < worker_count; ++i)
+				workers.emplace_back([this] { worker(); });
+
+			printf("Listening on %s with %zu workers, %zu MB cache\n", socket_path, worker_count, cache_bytes >> 20);
+
+			// The listen socket, the wake pipe, then every connection waiting for its next request.
+			std::vector<pollfd> poll_fd{ { listen_fd, POLLIN, 0 }, { wake_fd[0], POLLIN, 0 } };
+
+			for (;;) {
+
+				if (::poll(poll_fd.data(), poll_fd.size(), -1) < 0)
+					continue;
+
+				size_t ready{};
+
+				{
+					std::lock_guard<std::mutex> l{ queue_lock };
+
+					for (size_t i{ 2 }; i < poll_fd.size();) {
+
+						if (poll_fd[i].revents == 0) {
+							++i;
+							continue;
+						}
+
+						// Hang ups go through a worker too, its read fails and it closes the connection.
+						queue.push_back(poll_fd[i].fd);
+						++ready;
+
+						poll_fd[i] = poll_fd.back();
+						poll_fd.pop_back();
+					}
+				}
+
+				for (size_t i{}; i < ready; ++i)
+					queue_signal.notify_one();
+
+				if (poll_fd[1].revents) {
+
+					for (u8 b[64]; ::read(wake_fd[0], b, sizeof(b)) > 0;);
+
+					std::lock_guard<std::mutex> l{ idle_lock };
+
+					for (const int fd : idle)
+						poll_fd.push_back({ fd, POLLIN, 0 });
+
+					idle.clear();
+				}
+
+				if (poll_fd[0].revents) {
+
+					const int fd{ ::accept(listen_fd, nullptr, nullptr) };
+
+					if (fd < 0)
+						continue;
+
+					poll_fd.push_back({ fd, POLLIN, 0 });
+				}
+
+			}
+
+			return 1;
+		}
+
+	};
+
+	bool request(const int fd, const op o, const u32 flags, const std::vector<u8>& input, std::vector<u8>& output) {
+
+		const _request r{ u8(o), {}, flags, (u32)input.size() };
+
+		if (write_all(fd, &r, sizeof(r)) == 0 || write_all(fd, input.data(), input.size()) == 0)
+			return 0;
+
+		_response response{};
+
+		if (read_all(fd, &response, sizeof(response)) == 0)
+			return 0;
+
+		output.resize(response.size);
+
+		return read_all(fd, output.data(), output.size()) && response.status == status::ok;
+	}
+
+	// Load test - sends the same file over a number of connections and reports latency, then prints the server counters.
+	int run_client(const char* socket_path, const char* input_file, const size_t request_count, size_t connection_count, const u32 flags) {
+
+		const auto input{ read_file(input_file) };
+
+		if (input.size() == 0) {
+			printf("Failed to read %s\n", input_file);
+			return 0;
+		}
+
+		const op o{ std::string_view(input_file).find(".rrf") != std::string::npos ? op::decode : op::encode };
+
+		connection_count = std::clamp(connection_count, (size_t)1, std::max(request_count, (size_t)1));
+
+		std::vector<std::vector<u32>> latency(connection_count);
+		std::atomic<size_t> failed{};
+
+		const auto start{ std::chrono::steady_clock::now() };
+
+		{
+
+			std::vector<std::thread> threads{};
+
+			for (size_t c{}; c < connection_count; ++c) {
+
+				threads.emplace_back([&, c] {
+
+					const int fd{ open_socket(socket_path, 0) };
+
+					const size_t count{ request_count / connection_count + (c < request_count % connection_count) };
+
+					if (fd < 0) {
+						failed += count;
+						return;
+					}
+
+					std::vector<u8> output{};
+
+					for (size_t i{}; i < count; ++i) {
+
+						const auto s{ std::chrono::steady_clock::now() };
+
+						if (request(fd, o, flags, input, output) == 0)
+							++failed;
+
+						latency[c].push_back((u32)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - s).count());
+
+					}
+
+					::close(fd);
+
+				});
+
+			}
+
+			for (auto& t : threads)
+				t.join();
+
+		}
+
+		const double seconds{ std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() };
+
+		std::vector<u32> all{};
+
+		for (const auto& l : latency)
+			all.insert(all.end(), l.begin(), l.end());
+
+		std::sort(all.begin(), all.end());
+
+		const auto percentile = [&](const double p) {
+			return all.size() ? all[std::min(all.size() - 1, size_t(p * all.size()))] : 0u;
+		};
+
+		printf("%zu requests, %zu failed, %.1f req/s, p50 %u us, p99 %u us, max %u us\n",
+			all.size(), failed.load(), seconds > 0.0 ? double(all.size()) / seconds : 0.0,
+			percentile(0.5), percentile(0.99), all.size() ? all.back() : 0u);
+
+		if (const int fd{ open_socket(socket_path, 0) }; fd >= 0) {
+
+			std::vector<u8> stats{};
+
+			if (request(fd, op::stats, 0, {}, stats))
+				printf("%.*s", (int)stats.size(), (const char*)stats.data());
+
+			::close(fd);
+		}
+
+		return 1;
+	}
+
+}
+
+#endif
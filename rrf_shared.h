@@ -1,12 +1,26 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 #include <array>
 #include <bitset>
 #include <stdint.h>
 #include <math.h> // for roundf
 #include <fstream>
 #include <charconv>
+#include <bit>
+#include <string>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <thread>
+#include <atomic>
+#include <span>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RRF_SSE2
+#include <emmintrin.h>
+#endif
 
 
 #ifndef __RRF_SHARED_H
@@ -16,7 +30,7 @@ enum RRF_FLAG {
 
 	has_osr_header = 1 << 0,
 	force_lossless = 1 << 1, // Only affects raw input replays
-	keep_life_bar = 1 << 2,
+	keep_life_bar = 1 << 2, // life_bar holds the parsed life bar, it's spliced back in before the osr_header timestamp
 
 	gamemode_taiko = 1 << 3,
 	gamemode_fruits = 1 << 4,
@@ -24,8 +38,55 @@ enum RRF_FLAG {
 
 	using_screenspace = 1 << 6,
 
+	lowfi_residual = 1 << 7, // game_space_lowf_residual makes lowfi frames exact
+
+};
+
+// Precision of frames without any key pressed, key frames are always kept exact.
+enum class rrf_quality : unsigned {
+
+	standard, // 1 osu!pixel
+	coarse, // 2 osu!pixels
+	native, // The detected playfield scale, about 1 screen pixel
+	lossless, // Same as RRF_FLAG::force_lossless
+	max_error, // Coarsest power of two step from the playfield scale that stays within max_error osu!pixels
+	exact, // Lowfi frames at the native resolution plus residuals, bit exact like lossless
+
+};
+
+// Encoder that produced a file, only the speculative mode picks anything other than rule.
+enum class rrf_strategy : unsigned {
+
+	rule, // Screen space if the ratio matches, otherwise game space
+	game_space, // Game space even when screen space matches
+	native, // Game space at the detected playfield scale
+	residual, // Same as RRF_FLAG::lowfi_residual
+	lossless, // Same as RRF_FLAG::force_lossless
+	lowfi_step, // Game space at another power of two lowfi step, kept if its error still fits
+
 };
 
+enum class rrf_gamemode : unsigned {
+	standard,
+	taiko,
+	fruits,
+	mania,
+};
+
+constexpr rrf_gamemode get_gamemode(const unsigned flags) {
+
+	if (flags & RRF_FLAG::gamemode_mania)
+		return rrf_gamemode::mania;
+
+	if (flags & RRF_FLAG::gamemode_taiko)
+		return rrf_gamemode::taiko;
+
+	if (flags & RRF_FLAG::gamemode_fruits)
+		return rrf_gamemode::fruits;
+
+	return rrf_gamemode::standard;
+}
+
 enum class rrf_tag : unsigned char {
 
 	time_delta_table = 0,
@@ -65,6 +126,19 @@ enum class rrf_tag : unsigned char {
 	osr_header,
 	life_bar,
 
+	game_space_lowf_residual,
+
+	game_space_raw_info,
+	game_space_raw_x_delta,
+	game_space_raw_y_delta,
+
+	mania_key_chord,
+
+	time_delta_model,
+
+	game_space_float_x_sign_runs,
+	game_space_float_y_sign_runs,
+
 	custom_format,
 
 };
@@ -79,15 +153,21 @@ enum class rrf_tag : unsigned char {
 #define GAME_SPACE_EXP_SUSTAIN 8, 16
 
 #define GAME_SPACE_LOWFI_SIGN_SUSTAIN 4,4,4,8
+#define GAME_SPACE_LOWFI_RESIDUAL 4,8,8
+#define GAME_SPACE_RAW_COUNT 4,4,8
 
 #define EXP_ICHUNK_CONSUME 1,2,2
 #define EXP_ICHUNK_REPEAT 2,2,4
 
 #define BUCKET_TIME_STREAM 4,4,4,4
 
+#define LIFE_BAR_TIME 4,8,8
+#define LIFE_BAR_HP 4,4,8
+
 namespace DIAG {
-	bool using_screen{};
-	size_t INPUT_SIZE{}, OUTPUT_SIZE{};
+	thread_local bool using_screen{};
+	thread_local size_t INPUT_SIZE{}, OUTPUT_SIZE{};
+	thread_local rrf_strategy strategy{};
 
 }
 
@@ -116,6 +196,14 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
+// Set on the raw size of a compressed block that was split into independent LZMA blocks.
+// After it: u32 block count, u32 size per block, then the blocks, each with its own raw size and props.
+constexpr u32 LZMA_SPLIT{ 1u << 31 };
+
+// Limits on what a file can make the reader allocate. 2^24 frames is over 4 hours of 1000Hz raw input.
+constexpr u32 RRF_MAX_FRAME_COUNT{ 1u << 24 };
+constexpr u32 RRF_MAX_STREAM_SIZE{ 1u << 28 };
+
 #ifndef ON_SCOPE_EXIT
 
 template <typename F> struct on_scope_exit {
@@ -135,6 +223,48 @@ public:
 
 #endif
 
+// Set on threads that already have their share of the machine, parallel_for runs inline on them.
+// Keeps nested calls (a split stream inside a batch of replays) from multiplying the thread count.
+thread_local bool parallel_inline{};
+
+// Runs f(i) for every i < count, spread over the hardware threads with the calling thread taking part.
+template<typename F>
+void parallel_for(const size_t count, F&& f) {
+
+	if (parallel_inline) {
+
+		for (size_t i{}; i < count; ++i)
+			f(i);
+
+		return;
+	}
+
+	const size_t thread_count{ std::min<size_t>(count, std::max(std::thread::hardware_concurrency(), 1u)) };
+
+	std::atomic<size_t> next{};
+
+	const auto work = [&] {
+
+		parallel_inline = 1;
+
+		for (size_t i{}; (i = next++) < count;)
+			f(i);
+	};
+
+	std::vector<std::thread> threads{};
+
+	for (size_t i{ 1 }; i < thread_count; ++i)
+		threads.emplace_back(work);
+
+	ON_SCOPE_EXIT( parallel_inline = 0; );
+
+	work();
+
+	for (auto& t : threads)
+		t.join();
+
+}
+
 template<typename T>
 bool write_file(const char* file_name, const T& data) {
 
@@ -283,7 +413,14 @@ u32 small_read(const bit_stream& input, size_t& i) {
 	bit_count += c;
 	i += c + 1;
 	c = 0;
-	value = 1 << bit_count;
+
+	// Nothing written is this long, treat the rest of the stream as spent.
+	if (bit_count > 31) {
+		i = input.max_size();
+		return 0;
+	}
+
+	value = 1u << bit_count;
 	for (size_t size{ input.max_size() }; c < bit_count && (i + c) < size; ++c)
 		value |= u32(input[i + c]) << c;
 
@@ -392,6 +529,526 @@ u32 read_bucket(const bit_stream& input, size_t& i, const T... bits) {
 
 }
 
+namespace simd {
+
+	// Inclusive prefix sums, wrapping at the width of the type.
+
+	void prefix_sum(u8* v, const size_t size) {
+
+		size_t i{};
+		u8 carry{};
+
+#ifdef RRF_SSE2
+
+		__m128i c{ _mm_setzero_si128() };
+
+		for (; i + 16 <= size; i += 16) {
+
+			__m128i x{ _mm_loadu_si128((const __m128i*)(v + i)) };
+
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+			x = _mm_add_epi8(x, c);
+
+			_mm_storeu_si128((__m128i*)(v + i), x);
+
+			c = _mm_set1_epi8(char(_mm_extract_epi16(x, 7) >> 8));
+		}
+
+		carry = u8(_mm_cvtsi128_si32(c));
+
+#endif
+
+		for (; i < size; ++i)
+			v[i] = carry += v[i];
+
+	}
+
+	void prefix_sum(u16* v, const size_t size) {
+
+		size_t i{};
+		u16 carry{};
+
+#ifdef RRF_SSE2
+
+		__m128i c{ _mm_setzero_si128() };
+
+		for (; i + 8 <= size; i += 8) {
+
+			__m128i x{ _mm_loadu_si128((const __m128i*)(v + i)) };
+
+			x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+			x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+			x = _mm_add_epi16(x, _mm_slli_si128(x, 8));
+			x = _mm_add_epi16(x, c);
+
+			_mm_storeu_si128((__m128i*)(v + i), x);
+
+			c = _mm_set1_epi16(short(_mm_extract_epi16(x, 7)));
+		}
+
+		carry = u16(_mm_cvtsi128_si32(c));
+
+#endif
+
+		for (; i < size; ++i)
+			v[i] = carry += v[i];
+
+	}
+
+	void prefix_sum(int* v, const size_t size) {
+
+		size_t i{};
+		u32 carry{};
+
+#ifdef RRF_SSE2
+
+		__m128i c{ _mm_setzero_si128() };
+
+		for (; i + 4 <= size; i += 4) {
+
+			__m128i x{ _mm_loadu_si128((const __m128i*)(v + i)) };
+
+			x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+			x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+			x = _mm_add_epi32(x, c);
+
+			_mm_storeu_si128((__m128i*)(v + i), x);
+
+			c = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+		}
+
+		carry = u32(_mm_cvtsi128_si32(c));
+
+#endif
+
+		for (; i < size; ++i)
+			v[i] = int(carry += u32(v[i]));
+
+	}
+
+	void negate(int* v, const size_t size) {
+
+		size_t i{};
+
+#ifdef RRF_SSE2
+
+		for (; i + 4 <= size; i += 4)
+			_mm_storeu_si128((__m128i*)(v + i), _mm_sub_epi32(_mm_setzero_si128(), _mm_loadu_si128((const __m128i*)(v + i))));
+
+#endif
+
+		for (; i < size; ++i)
+			v[i] = int(0u - u32(v[i]));
+
+	}
+
+	// Bit exact with float(v) / divisor. Under 2^24 the quotient can't sit within 2^-49 of a float midpoint,
+	// so going through a double reciprocal rounds the same way. Larger values keep the division.
+	void divide(const int* v, float* output, const size_t size, const float divisor) {
+
+		constexpr int EXACT{ 1 << 24 };
+
+		const double reciprocal{ 1.0 / double(divisor) };
+
+		size_t i{};
+
+#ifdef RRF_SSE2
+
+		const __m128d r{ _mm_set1_pd(reciprocal) };
+		const __m128i limit{ _mm_set1_epi32(EXACT) }, neg_limit{ _mm_set1_epi32(-EXACT) };
+
+		for (; i + 4 <= size; i += 4) {
+
+			const __m128i x{ _mm_loadu_si128((const __m128i*)(v + i)) };
+
+			if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpgt_epi32(x, limit), _mm_cmplt_epi32(x, neg_limit)))) [[unlikely]] {
+
+				for (size_t z{}; z < 4; ++z)
+					output[i + z] = float(v[i + z]) / divisor;
+
+				continue;
+			}
+
+			const __m128 lo{ _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtepi32_pd(x), r)) };
+			const __m128 hi{ _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(x, 8)), r)) };
+
+			_mm_storeu_ps(output + i, _mm_movelh_ps(lo, hi));
+		}
+
+#endif
+
+		for (; i < size; ++i) {
+
+			if (v[i] > EXACT || v[i] < -EXACT) [[unlikely]]
+				output[i] = float(v[i]) / divisor;
+			else
+				output[i] = float(double(v[i]) * reciprocal);
+
+		}
+
+	}
+
+}
+
+// Runs of a two state sequence where some elements keep whatever state came before them, like signs with zeros in between.
+// The state starts off. The first run counts the elements before the first change, every later run one less than its
+// length, so each value is the number of elements that didn't change the state.
+namespace run_length {
+
+	// Sign runs of ints or of the float bits, zeros (and -0.f) continue the current run.
+	template<typename T>
+	std::vector<u32> sign_runs(const T* v, const size_t size) {
+
+		static_assert(sizeof(T) == 4);
+
+		std::vector<u32> runs{ 0 };
+
+		u32 state{};
+
+		const auto step = [&](const u32 negative, const u32 keep) {
+
+			if (keep || negative == state) {
+				++runs.back();
+				return;
+			}
+
+			runs.push_back(0);
+			state ^= 1;
+
+		};
+
+		size_t i{};
+
+#ifdef RRF_SSE2
+
+		const auto masks = [&](const size_t at, u32& negative, u32& keep) {
+
+			const __m128i x{ _mm_loadu_si128((const __m128i*)(v + at)) };
+
+			// Sign bits for the state, zero compares for what keeps it.
+			negative = (u32)_mm_movemask_ps(_mm_castsi128_ps(x));
+
+			if constexpr (std::is_same_v<T, float>)
+				keep = (u32)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_slli_epi32(x, 1), _mm_setzero_si128())));
+			else
+				keep = (u32)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(x, _mm_setzero_si128())));
+
+		};
+
+		for (; i + 8 <= size; i += 8) {
+
+			u32 n0, k0, n1, k1;
+
+			masks(i, n0, k0);
+			masks(i + 4, n1, k1);
+
+			const u32 negative{ n0 | (n1 << 4) }, keep{ k0 | (k1 << 4) };
+
+			// Nothing here changes the state.
+			if (((negative ^ (0u - state)) & ~keep & 0xff) == 0) [[likely]] {
+				runs.back() += 8;
+				continue;
+			}
+
+			for (u32 z{}; z < 8; ++z)
+				step((negative >> z) & 1, (keep >> z) & 1);
+
+		}
+
+#endif
+
+		for (; i < size; ++i) {
+
+			const u32 b{ std::bit_cast<u32>(v[i]) };
+
+			if constexpr (std::is_same_v<T, float>)
+				step(b >> 31, (b << 1) == 0);
+			else
+				step(b >> 31, b == 0);
+
+		}
+
+		return runs;
+	}
+
+	template<typename ...T>
+	void write(const std::vector<u32>& runs, bit_stream& output, const T... bits) {
+
+		for (const auto v : runs)
+			write_bucket(v, output, bits...);
+
+	}
+
+	// Calls apply(start, end) for every run in the on state, reads until size elements are covered but always at least one run.
+	template<typename F, typename ...T>
+	void read(const bit_stream& input, size_t& bit, const size_t size, F&& apply, const T... bits) {
+
+		size_t start{};
+		bool on{};
+
+		do {
+
+			const size_t end{ start + read_bucket(input, bit, bits...) + size_t(start != 0 || on) };
+
+			if (on)
+				apply(std::min(start, size), std::min(end, size));
+
+			start = end;
+			on = !on;
+
+		} while (start < size && bit < input.max_size());
+
+	}
+
+	// Bucket layouts an adaptive stream picks from, the index goes in front as 2 bits.
+	template<typename F>
+	void with_preset(const u32 preset, F&& f) {
+
+		switch (preset & 3) {
+		case 0: return f(2, 4, 8);
+		case 1: return f(4, 4, 4, 8);
+		case 2: return f(8);
+		default: return f(8, 8, 16);
+		}
+
+	}
+
+	void write_adaptive(const std::vector<u32>& runs, bit_stream& output) {
+
+		bit_stream best{};
+		u32 best_preset{};
+
+		for (u32 preset{}; preset < 4; ++preset) {
+
+			bit_stream s{};
+
+			with_preset(preset, [&](const auto... bits) { write(runs, s, bits...); });
+
+			if (preset == 0 || s.size() < best.size()) {
+				best = std::move(s);
+				best_preset = preset;
+			}
+
+		}
+
+		output.push_back(best_preset & 1);
+		output.push_back(best_preset >> 1);
+
+		output.append(best);
+
+	}
+
+	template<typename F>
+	void read_adaptive(const bit_stream& input, size_t& bit, const size_t size, F&& apply) {
+
+		u32 preset{};
+
+		for (u32 z{}; z < 2 && bit < input.max_size(); ++z)
+			preset |= u32(input[bit++]) << z;
+
+		with_preset(preset, [&](const auto... bits) { read(input, bit, size, apply, bits...); });
+
+	}
+
+}
+
+namespace life_bar {
+
+	// The life bar is stored in the osr header as a "time|hp," string.
+	// Both values get delta coded, hp is kept as a fixed point decimal so the text can be rebuilt byte for byte.
+
+	constexpr u32 MAX_DECIMALS{ 8 };
+
+	constexpr u64 pow10(u32 i) {
+
+		u64 r{ 1 };
+
+		while (i--)
+			r *= 10;
+
+		return r;
+	}
+
+	// Returns the full osu! string (0x0b, uleb128 length, text)
+	std::vector<u8> decode(const bit_stream& input) {
+
+		size_t i{};
+
+		const auto count{ read_bucket(input, i, 8, 8, 16) };
+		const bool trailing_comma{ small_read<1>(input, i) != 0 };
+		const auto max_decimals{ std::min(small_read<3>(input, i), MAX_DECIMALS) };
+
+		std::string text{};
+		text.reserve(std::min<size_t>(count, input.max_size()) * 16);
+
+		int time{};
+		u64 hp{};
+
+		// Every entry takes some bits, a count past the end of the stream is damage.
+		for (size_t c{}; c < count && i < input.max_size(); ++c) {
+
+			const u32 time_delta{ read_bucket(input, i, LIFE_BAR_TIME) };
+			time = int(small_read<1>(input, i) ? u32(time) - time_delta : u32(time) + time_delta);
+
+			const auto decimals{ std::min(read_bucket(input, i, 2), max_decimals) };
+
+			const u64 hp_delta{ read_bucket(input, i, LIFE_BAR_HP) };
+			hp = small_read<1>(input, i) ? hp - hp_delta : hp + hp_delta;
+
+			char buffer[48];
+
+			char* p{ std::to_chars(buffer, buffer + sizeof(buffer), time).ptr };
+			*(p++) = '|';
+
+			const u64 value{ hp / pow10(max_decimals - decimals) };
+
+			p = std::to_chars(p, buffer + sizeof(buffer), value / pow10(decimals)).ptr;
+
+			if (decimals) {
+
+				*(p++) = '.';
+
+				u64 fraction{ value % pow10(decimals) };
+
+				for (size_t d{ decimals }; d--; fraction /= 10)
+					p[d] = char('0' + fraction % 10);
+
+				p += decimals;
+			}
+
+			if (c + 1 < count || trailing_comma)
+				*(p++) = ',';
+
+			text.append(buffer, p);
+
+		}
+
+		std::vector<u8> output{};
+		output.reserve(text.size() + 6);
+
+		output.push_back(0x0b);
+
+		for (size_t len{ text.size() };; len >>= 7) {
+
+			if (len < 0x80) {
+				output.push_back(u8(len));
+				break;
+			}
+
+			output.push_back(u8(len) | 0x80);
+		}
+
+		output.insert(output.end(), text.begin(), text.end());
+
+		return output;
+	}
+
+	// Returns 0 if the string can't be rebuilt exactly, in that case it should be kept as raw bytes.
+	bool encode(const u8* start, const u8* end, bit_stream& output) {
+
+		output.clear();
+
+		if (end - start < 2 || *start != 0x0b)
+			return 0;
+
+		const u8* p{ start + 1 };
+
+		for (; p < end && (*p & 0x80); ++p);
+
+		if (++p >= end)
+			return 0;
+
+		struct _entry {
+			int time;
+			u64 value;
+			u32 decimals;
+		};
+
+		std::vector<_entry> entry{};
+
+		u32 max_decimals{};
+
+		for (const u8* entry_start{ p }; entry_start < end;) {
+
+			const u8* entry_end{ std::find(entry_start, end, u8(',')) };
+			const u8* sep{ std::find(entry_start, entry_end, u8('|')) };
+
+			if (sep == entry_end)
+				return 0;
+
+			auto& e{ entry.emplace_back() };
+
+			if (std::from_chars((const char*)entry_start, (const char*)sep, e.time).ptr != (const char*)sep)
+				return 0;
+
+			const u8* point{ std::find(sep + 1, entry_end, u8('.')) };
+
+			if (std::from_chars((const char*)sep + 1, (const char*)point, e.value).ptr != (const char*)point)
+				return 0;
+
+			if (point != entry_end) {
+
+				e.decimals = u32(entry_end - point - 1);
+
+				if (e.decimals == 0 || e.decimals > MAX_DECIMALS)
+					return 0;
+
+				u64 fraction{};
+
+				if (std::from_chars((const char*)point + 1, (const char*)entry_end, fraction).ptr != (const char*)entry_end)
+					return 0;
+
+				e.value = e.value * pow10(e.decimals) + fraction;
+
+			}
+
+			max_decimals = std::max(max_decimals, e.decimals);
+
+			entry_start = entry_end + 1;
+		}
+
+		if (entry.empty())
+			return 0;
+
+		write_bucket(entry.size(), output, 8, 8, 16);
+		output.push_back(end[-1] == u8(','));
+		small_write<3>(max_decimals, output);
+
+		int last_time{};
+		u64 last_hp{};
+
+		for (const auto& e : entry) {
+
+			const u64 hp{ e.value * pow10(max_decimals - e.decimals) };
+
+			if (hp >= (1u << 31))
+				return 0;
+
+			const int time_delta{ e.time - last_time };
+
+			write_bucket(abs(time_delta), output, LIFE_BAR_TIME);
+			output.push_back(time_delta < 0);
+
+			write_bucket(e.decimals, output, 2);
+
+			write_bucket(u32(hp > last_hp ? hp - last_hp : last_hp - hp), output, LIFE_BAR_HP);
+			output.push_back(hp < last_hp);
+
+			last_time = e.time;
+			last_hp = hp;
+
+		}
+
+		const auto rebuilt{ decode(output) };
+
+		return rebuilt.size() == size_t(end - start) && memcmp(rebuilt.data(), start, rebuilt.size()) == 0;
+	}
+
+}
+
 struct _data_chunk {
 	u32 size : 31, is_compressed : 1;
 };
@@ -404,12 +1061,117 @@ struct _rrf_data_block {
 	u32 size : 31, is_compressed : 1;
 };
 
+// Small files lose a good part of their size to the 16 byte header, 5 bytes per block and 9 per LZMA stream.
+// The compact form starts with MARKER where the full header has the low byte of version 0, then
+// varint flags, varint frame count, a varint mask of the blocks present in the gamemode's tag order,
+// varint size << 2 | kind per block, then the blocks in that order.
+namespace compact_header {
+
+	constexpr u8 VERSION{ 1 };
+	constexpr u8 MARKER{ 0x80 | VERSION };
+
+	// The comp:: presets only differ in lc/lp/pb as far as the decoder is concerned, and dictSize is always the
+	// stream size. So the props byte names the preset and the dictionary is taken to be the whole output.
+	enum kind : u8 {
+		raw,
+		lzma, // u32 size, 5 props then the stream, as in the full header
+		lzma_short, // varint size, the lc/lp/pb props byte then the stream
+	};
+
+	constexpr size_t MAX_PREFIX{ 10 + 1 };
+
+	#define COMMON_HEAD rrf_tag::osr_header, rrf_tag::life_bar, rrf_tag::time_delta_model, rrf_tag::time_delta_table, rrf_tag::time_delta_stream
+
+	constexpr rrf_tag ORDER_STANDARD[]{
+		COMMON_HEAD,
+		rrf_tag::screen_space_info, rrf_tag::screen_space_sign_sustain, rrf_tag::screen_space_x_delta, rrf_tag::screen_space_y_delta,
+		rrf_tag::game_space_lowf_residual, rrf_tag::game_space_info, rrf_tag::game_space_lowf_sign, rrf_tag::game_space_lowf_delta,
+		rrf_tag::game_space_raw_info, rrf_tag::game_space_raw_x_delta, rrf_tag::game_space_raw_y_delta,
+		rrf_tag::game_space_float_x_sign_runs, rrf_tag::game_space_float_x_exponent_absolute_table,
+		rrf_tag::game_space_float_x_exponent_sustain, rrf_tag::game_space_float_x_exponent_stream, rrf_tag::game_space_float_x_mantissa,
+		rrf_tag::game_space_float_y_sign_runs, rrf_tag::game_space_float_y_exponent_absolute_table,
+		rrf_tag::game_space_float_y_exponent_sustain, rrf_tag::game_space_float_y_exponent_stream, rrf_tag::game_space_float_y_mantissa,
+		rrf_tag::key_bit_stream,
+	};
+
+	constexpr rrf_tag ORDER_TAIKO[]{ COMMON_HEAD, rrf_tag::key_bit_stream };
+
+	constexpr rrf_tag ORDER_FRUITS[]{
+		COMMON_HEAD,
+		rrf_tag::fruits_exp_sustain, rrf_tag::game_space_float_x_exponent_absolute_table,
+		rrf_tag::game_space_float_x_exponent_sustain, rrf_tag::game_space_float_x_exponent_stream, rrf_tag::game_space_float_x_mantissa,
+		rrf_tag::key_bit_stream,
+	};
+
+	constexpr rrf_tag ORDER_MANIA[]{ COMMON_HEAD, rrf_tag::mania_scroll_data, rrf_tag::key_bit_stream, rrf_tag::mania_key_chord };
+
+	#undef COMMON_HEAD
+
+	// Tags outside of this order need the full header, it can't grow past 64.
+	constexpr std::span<const rrf_tag> order(const rrf_gamemode mode) {
+
+		switch (mode) {
+		case rrf_gamemode::taiko: return ORDER_TAIKO;
+		case rrf_gamemode::fruits: return ORDER_FRUITS;
+		case rrf_gamemode::mania: return ORDER_MANIA;
+		default: return ORDER_STANDARD;
+		}
+
+	}
+
+	constexpr size_t varint_size(u64 v) {
+
+		size_t s{ 1 };
+
+		while (v >>= 7)
+			++s;
+
+		return s;
+	}
+
+	u8* put_varint(u8* output, u64 v) {
+
+		for (; v >= 0x80; v >>= 7)
+			*(output++) = u8(v | 0x80);
+
+		*(output++) = u8(v);
+
+		return output;
+	}
+
+	bool get_varint(const u8*& input, const u8* const end, u64& v) {
+
+		v = 0;
+
+		for (u32 shift{}; input != end && shift < 64; shift += 7) {
+
+			const u8 b{ *(input++) };
+
+			v |= u64(b & 0x7f) << shift;
+
+			if ((b & 0x80) == 0)
+				return 1;
+		}
+
+		return 0;
+	}
+
+}
+
 struct _game_space_info {
 
 	u32 lowfi_count, lowf_delta_y_start_bit;
 	float lowfi_resolution;
 	u32 exp_sustain_count[2];
 
+	u32 quality; // rrf_quality the lowfi resolution was picked with, older files stop before this
+
+};
+
+struct _raw_lattice_info {
+
+	u32 axis_mask; // Axes coded as mouse counts instead of floats
+	float step[2];
 
 };
 
@@ -419,7 +1181,226 @@ struct _osr_frame {
 	u32 keys;
 };
 
-using _osr = std::vector<_osr_frame>;
+// Columns start on a cache line, so SIMD loops never straddle one at the start.
+template<typename T>
+struct aligned_allocator {
+
+	using value_type = T;
+
+	static constexpr std::align_val_t ALIGNMENT{ 64 };
+
+	aligned_allocator() = default;
+
+	template<typename U>
+	aligned_allocator(const aligned_allocator<U>&) {}
+
+	T* allocate(const size_t n) {
+		return (T*)::operator new(n * sizeof(T), ALIGNMENT);
+	}
+
+	void deallocate(T* p, size_t) {
+		::operator delete(p, ALIGNMENT);
+	}
+
+	template<typename U>
+	bool operator==(const aligned_allocator<U>&) const { return 1; }
+
+};
+
+template<typename T>
+using aligned_vector = std::vector<T, aligned_allocator<T>>;
+
+// Replays are stored a column per field, _osr_frame is only used at the edges.
+struct _osr {
+
+	aligned_vector<int> delta;
+	aligned_vector<float> x, y;
+	aligned_vector<u32> keys;
+
+	size_t size() const {
+		return delta.size();
+	}
+
+	void reserve(const size_t size) {
+		delta.reserve(size); x.reserve(size); y.reserve(size); keys.reserve(size);
+	}
+
+	void resize(const size_t size) {
+		delta.resize(size); x.resize(size); y.resize(size); keys.resize(size);
+	}
+
+	void push_back(const _osr_frame& f) {
+		delta.push_back(f.delta); x.push_back(f.x); y.push_back(f.y); keys.push_back(f.keys);
+	}
+
+	void pop_back() {
+		delta.pop_back(); x.pop_back(); y.pop_back(); keys.pop_back();
+	}
+
+	_osr_frame operator[](const size_t i) const {
+		return { delta[i], x[i], y[i], keys[i] };
+	}
+
+	_osr_frame back() const {
+		return (*this)[size() - 1];
+	}
+
+};
+
+// Float bits remapped so unsigned order matches float order, the difference of two is their distance in ulps.
+u32 ordered_float(const float f) {
+
+	const u32 b{ std::bit_cast<u32>(f) };
+
+	return (b & 0x80000000u) ? ~b : b | 0x80000000u;
+}
+
+float unordered_float(const u32 o) {
+	return std::bit_cast<float>((o & 0x80000000u) ? o & 0x7fffffffu : ~o);
+}
+
+// Raw input key frames chain as x = fl(x_prev + fl(c * step)), step being the sensitivity multiplier.
+// The integer mouse counts c are coded instead of the floats, positions that don't chain are escaped as raw bits.
+namespace raw_lattice {
+
+	float next(const float prev, const int c, const float step) {
+
+		// Kept as two roundings, a fused multiply add would not match what the game did.
+		// The product is made opaque so -ffp-contract=fast (gcc's default) or /fp:contract can't fuse it.
+#ifdef __GNUC__
+		float d{ float(c) * step };
+		__asm__("" : "+m"(d));
+#else
+		const volatile float d{ float(c) * step };
+#endif
+
+		return prev + d;
+	}
+
+	// 0 is the escape, counts are zigzag coded after it.
+	void write_count(const int c, bit_stream& output) {
+		write_bucket(((u32(c) << 1) ^ u32(c >> 31)) + 1, output, GAME_SPACE_RAW_COUNT);
+	}
+
+	void write_escape(const float v, bit_stream& output) {
+
+		write_bucket(0, output, GAME_SPACE_RAW_COUNT);
+
+		const u32 b{ std::bit_cast<u32>(v) };
+
+		for (size_t i{}; i < 32; ++i)
+			output.push_back((b >> i) & 1);
+
+	}
+
+	float read(const bit_stream& input, size_t& i, const float prev, const float step) {
+
+		const u32 code{ read_bucket(input, i, GAME_SPACE_RAW_COUNT) };
+
+		if (code != 0) [[likely]] {
+
+			const u32 z{ code - 1 };
+
+			return next(prev, int(z >> 1) ^ -int(z & 1), step);
+		}
+
+		u32 b{};
+
+		for (size_t z{}; z < 32 && i < input.max_size(); ++z)
+			b |= u32(input[i++]) << z;
+
+		return std::bit_cast<float>(b);
+	}
+
+}
+
+// Frame times that sit on a grid of sum ms every period frames, 16/17/17 from a 60Hz client is 50 every 3.
+// Extra frames between grid points don't move it and small drift pulls it along, so only those frames cost anything.
+struct _time_cadence {
+
+	u32 period, sum;
+
+	// From the last frame to the next grid point, in 1/period ms.
+	int64_t ahead{ sum };
+
+	int predict() const {
+		return int(std::max<int64_t>(ahead, 0) / period);
+	}
+
+	void update(const int delta) {
+
+		const int64_t half{ sum / 2 };
+
+		int64_t a{ ahead - int64_t(delta) * period };
+
+		if (a >= period) {
+
+			// A little early is drift, further is an extra frame.
+			ahead = a < period + half ? period - 1 + sum : a;
+
+			return;
+		}
+
+		// Late by more than half a step skips grid points, what's left is drift.
+		if (a < -half)
+			a += (-half - a + sum - 1) / sum * sum;
+
+		ahead = std::max<int64_t>(a, 0) + sum;
+
+	}
+
+};
+
+// Mania keys as chords across all columns, the frame gap, the set of columns pressed and how long each one is held.
+// The set goes through a move to front list picked by the previous chord, so repeating patterns and jacks cost a byte.
+namespace mania_chord {
+
+	constexpr u32 CONTEXT_BITS{ 10 }, DEPTH{ 16 };
+
+	struct _model {
+
+		// 0 is an empty slot, a chord always presses at least one column.
+		std::vector<u32> list = std::vector<u32>(DEPTH << CONTEXT_BITS);
+
+		u32 previous{};
+
+		u32* context() {
+			return list.data() + ((previous * 0x9e3779b1u) >> (32 - CONTEXT_BITS)) * DEPTH;
+		}
+
+		// 1 based position in the list, 0 means the set is written raw.
+		u32 find(const u32 v) {
+
+			const auto* l{ context() };
+
+			for (u32 i{}; i < DEPTH; ++i) {
+				if (l[i] == v)
+					return i + 1;
+			}
+
+			return 0;
+		}
+
+		// code is 1 to DEPTH.
+		u32 get(const u32 code) {
+			return context()[code - 1];
+		}
+
+		void update(const u32 v, const u32 code) {
+
+			auto* l{ context() };
+
+			for (u32 i{ code ? code - 1 : DEPTH - 1 }; i > 0; --i)
+				l[i] = l[i - 1];
+
+			l[0] = v;
+			previous = v;
+
+		}
+
+	};
+
+}
 
 typedef union {
 	float f;
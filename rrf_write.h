@@ -2,7 +2,14 @@
 
 #include "rrf_shared.h"
 #include <algorithm>
-#include <intrin.h> // _BitScanForward 
+#include <cstring>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
 void add_to_u8(std::vector<u8>& output, u32 input) {
 
@@ -15,6 +22,9 @@ void add_to_u8(std::vector<u8>& output, u32 input) {
 
 void add_to_u8(std::vector<u8>& output, const void* src, size_t size) {
 
+	if (size == 0)
+		return;
+
 	const auto i{ output.size() };
 
 	output.resize(i + size);
@@ -26,43 +36,164 @@ void add_to_u8(std::vector<u8>& output, const void* src, size_t size) {
 template<typename T>
 void add_to_u8(std::vector<u8>& output, const std::vector<T>& input) {
 
-	constexpr auto SIZE{ sizeof(T) };
+	add_to_u8(output, input.data(), input.size() * sizeof(T));
+}
+
+// Frequency ordered symbol tables, index 0 is the most common symbol.
+namespace symbol {
 
-	const auto i{ output.size() };
+	// Stable LSD radix sort by descending count, ties keep first occurrence order.
+	std::vector<u32> order_by_count(const std::vector<u32>& count) {
 
-	output.resize(i + input.size() * SIZE);
+		const size_t size{ count.size() };
 
-	memcpy(output.data() + i, input.data(), input.size() * SIZE);
-}
+		std::vector<u32> order(size), temp(size);
 
-void unique_add(u32 v, std::vector<std::pair<u32, u32>>& b) {
+		for (u32 i{}; i < size; ++i)
+			order[i] = i;
 
-	for (auto& t : b) {
-		if (t.first == v) {
-			++t.second;
-			return;
+		for (u32 shift{}; shift < 32; shift += 8) {
+
+			u32 bucket[257]{};
+
+			for (const auto i : order)
+				++bucket[((~count[i] >> shift) & 0xff) + 1];
+
+			// Every symbol shares this digit, the pass would be a copy.
+			if (std::find(bucket + 1, bucket + 257, size) != bucket + 257)
+				continue;
+
+			for (size_t i{ 1 }; i < 257; ++i)
+				bucket[i] += bucket[i - 1];
+
+			for (const auto i : order)
+				temp[bucket[(~count[i] >> shift) & 0xff]++] = i;
+
+			order.swap(temp);
 		}
+
+		return order;
 	}
 
-	b.push_back({ v,1 });
+	// Direct mapped, used for exponents.
+	struct _byte_table {
 
-};
+		u32 count[256]{};
+		u8 index[256]{};
+
+		std::vector<u8> table;
 
-u32 unique_get_(u32 v, const std::vector<std::pair<u32, u32>>& b) {
+		void add(const u8 v) {
 
-	for (size_t i{}; i < b.size(); ++i) {
+			if (count[v]++ == 0)
+				table.push_back(v);
 
-		if (b[i].first == v) {
-			return i;
 		}
 
-	}
-	return 0;
-};
+		void build() {
 
-const auto pair_sort = [](const auto& x, const auto& y) {
-	return x.second > y.second;
-};
+			std::vector<u32> c(table.size());
+
+			for (size_t i{}; i < table.size(); ++i)
+				c[i] = count[table[i]];
+
+			const auto order{ order_by_count(c) };
+			const auto first{ table };
+
+			for (size_t i{}; i < order.size(); ++i)
+				index[table[i] = first[order[i]]] = (u8)i;
+
+		}
+
+		u8 get(const u8 v) const {
+			return index[v];
+		}
+
+	};
+
+	// Flat open addressing map, used for frame deltas.
+	struct _int_table {
+
+		std::vector<int> table;
+		std::vector<u32> count;
+
+		// 1 based position in table, 0 is empty.
+		std::vector<u32> slot = std::vector<u32>(64);
+
+		static u32 hash(const int v) {
+
+			const u32 h{ u32(v) * 0x9e3779b1u };
+
+			return h ^ (h >> 15);
+		}
+
+		u32& find_slot(const int v) {
+
+			const u32 mask{ u32(slot.size() - 1) };
+
+			for (u32 i{ hash(v) & mask };; i = (i + 1) & mask) {
+
+				auto& s{ slot[i] };
+
+				if (s == 0 || table[s - 1] == v)
+					return s;
+			}
+
+		}
+
+		void rehash(const size_t size) {
+
+			slot.assign(size, 0);
+
+			for (u32 i{}; i < table.size(); ++i)
+				find_slot(table[i]) = i + 1;
+
+		}
+
+		void add(const int v) {
+
+			auto& s{ find_slot(v) };
+
+			if (s != 0) [[likely]] {
+				++count[s - 1];
+				return;
+			}
+
+			table.push_back(v);
+			count.push_back(1);
+
+			s = (u32)table.size();
+
+			if (table.size() * 2 > slot.size()) [[unlikely]]
+				rehash(slot.size() * 2);
+
+		}
+
+		void build() {
+
+			const auto order{ order_by_count(count) };
+			const auto first_table{ table };
+			const auto first_count{ count };
+
+			for (size_t i{}; i < order.size(); ++i) {
+				table[i] = first_table[order[i]];
+				count[i] = first_count[order[i]];
+			}
+
+			rehash(slot.size());
+
+		}
+
+		u32 get(const int v) {
+
+			const auto s{ find_slot(v) };
+
+			return s ? s - 1 : 0;
+		}
+
+	};
+
+}
 
 namespace comp {
 
@@ -225,6 +356,48 @@ namespace comp {
 		return p;
 	}
 
+	CLzmaEncProps lowf_residual_prop(size_t size) {
+
+		size /= 8;
+
+		CLzmaEncProps p;
+		LzmaEncProps_Init(&p);
+
+		p.level = 5;
+
+		p.fb = 32;
+		p.mc = 16;
+
+		p.numHashBytes = 3;
+
+		p.lc = size <= 12288 ? 1 : 2;
+
+		p.pb = 0;
+
+		return p;
+	}
+
+	CLzmaEncProps raw_count_prop(size_t size) {
+
+		size /= 8;
+
+		CLzmaEncProps p;
+		LzmaEncProps_Init(&p);
+
+		p.level = 5;
+
+		p.fb = 32;
+		p.mc = 16;
+
+		p.numHashBytes = 3;
+
+		p.lc = size <= 12288 ? 1 : 2;
+
+		p.pb = 0;
+
+		return p;
+	}
+
 	CLzmaEncProps lowf_sign_prop(size_t size) {
 
 		size /= 8;
@@ -288,20 +461,43 @@ namespace comp {
 		return p;
 	}
 
-	std::vector<char> compress(const bit_stream& b, CLzmaEncProps prop) {
+	CLzmaEncProps life_bar_prop() {
+
+		CLzmaEncProps p;
+		LzmaEncProps_Init(&p);
+
+		p.level = 5;
+
+		p.fb = 32;
+		p.mc = 16;
+
+		p.numHashBytes = 3;
+
+		p.lc = 1;
+
+		p.pb = 0;
+
+		return p;
+	}
+
+	// Streams at least twice this size are split into blocks of it that compress in parallel, 0 keeps every stream whole.
+	// Set from rrf_encode_options::block_size for the duration of an encode.
+	thread_local size_t block_size{ 1 << 20 };
+
+	std::vector<char> compress(const u8* data, const size_t size, CLzmaEncProps prop) {
 
 		std::vector<char> ret;
-		ret.resize(std::max(int(b.data.size() * 1.5f), 1024));
+		ret.resize(std::max(int(size * 1.5f), 1024));
 
 		size_t len{ ret.size() - 9 };
 
-		prop.dictSize = b.data.size();
+		prop.dictSize = size;
 
-		*(u32*)ret.data() = b.data.size();
+		*(u32*)ret.data() = size;
 
 		SizeT propsSize = 5;
 
-		LzmaEncode((u8*)ret.data() + 9, &len, (u8*)b.data.data(), b.data.size(),
+		LzmaEncode((u8*)ret.data() + 9, &len, data, size,
 			&prop, (u8*)ret.data() + 4, &propsSize, 0,
 			0,
 			&lzma_allocFuncs, &lzma_allocFuncs
@@ -311,6 +507,38 @@ namespace comp {
 		return ret;
 	}
 
+	std::vector<char> compress_split(const u8* data, const size_t size, const CLzmaEncProps& prop) {
+
+		const size_t count{ (size + block_size - 1) / block_size };
+
+		std::vector<std::vector<char>> block(count);
+
+		parallel_for(count, [&](const size_t i) {
+			block[i] = compress(data + i * block_size, std::min(block_size, size - i * block_size), prop);
+		});
+
+		std::vector<char> ret;
+		ret.resize(8 + count * 4);
+
+		*(u32*)ret.data() = u32(size) | LZMA_SPLIT;
+		*(u32*)(ret.data() + 4) = u32(count);
+
+		for (size_t i{}; i < count; ++i) {
+			*(u32*)(ret.data() + 8 + i * 4) = u32(block[i].size());
+			ret.insert(ret.end(), block[i].begin(), block[i].end());
+		}
+
+		return ret;
+	}
+
+	std::vector<char> compress(const bit_stream& b, CLzmaEncProps prop) {
+
+		if (block_size && b.data.size() >= 2 * block_size) [[unlikely]]
+			return compress_split(b.data.data(), b.data.size(), prop);
+
+		return compress(b.data.data(), b.data.size(), prop);
+	}
+
 	std::vector<char> compress_debug(const bit_stream& b, CLzmaEncProps prop) {
 
 		const auto ret = compress(b, prop);
@@ -342,28 +570,10 @@ struct sign_chunk {
 
 struct _exponent_stream {
 
-	std::vector<u8> absolute_table;
-
-	void set_absolute_table(const std::vector<std::pair<u32, u32>>& input) {
-
-		absolute_table.resize(input.size());
-
-		u8* p = absolute_table.data();
-
-		for (auto& [_exp, freq] : input)
-			*(p++) = _exp;
-
-	}
+	symbol::_byte_table absolute;
 
 	u8 get_absolute_index(const u8 e) const {
-
-		for (size_t i{}, size{ absolute_table.size() }; i < size; ++i) {
-
-			if (absolute_table[i] == e)
-				return i;
-		}
-
-		return 0;
+		return absolute.get(e);
 	}
 
 	u32 chunk_count;
@@ -455,8 +665,7 @@ struct _exponent_stream {
 		// Construct absolute table
 		{
 
-			std::vector<std::pair<u32, u32>> tbl{};
-			tbl.push_back({ (u32)input[0], 1 });
+			absolute.add(input[0]);
 
 			int last{ (int)input[0] };
 
@@ -468,7 +677,7 @@ struct _exponent_stream {
 
 				if (abs(delta) != 1) {
 				WRITE_ABS_pre:
-					unique_add((u32)c.exp, tbl);
+					absolute.add(c.exp);
 					last = (int)c.exp;
 					continue;
 				}
@@ -485,14 +694,14 @@ struct _exponent_stream {
 
 			}
 
-			std::sort(tbl.begin(), tbl.end(), pair_sort);
-
-			set_absolute_table(tbl);
+			absolute.build();
 
 		}
 
 		{
 
+			const auto& absolute_table{ absolute.table };
+
 			int last{ (int)absolute_table[0] };
 
 			write_bucket<3>(absolute_table[0] ^ 128, abs_table_stream, 4);
@@ -654,26 +863,7 @@ struct _low_fidelity_delta_stream {
 		if (input.size() == 0)
 			return;
 
-		const u8 starting_sign{ input[0] <= 0 };
-
-		std::vector<u32> sign_change;
-		sign_change.push_back({});
-
-		bool last_sign{};
-
-		for (auto v : input) {
-
-			if (v == 0 || (v <= 0) == last_sign) {
-				++sign_change.back();
-				continue;
-			}
-
-			sign_change.push_back(0);
-			last_sign = !last_sign;
-		}
-
-		for (auto& v : sign_change)
-			write_bucket(v, sign_sustain, GAME_SPACE_LOWFI_SIGN_SUSTAIN);
+		run_length::write(run_length::sign_runs(input.data(), input.size()), sign_sustain, GAME_SPACE_LOWFI_SIGN_SUSTAIN);
 
 	}
 
@@ -688,210 +878,345 @@ struct _low_fidelity_delta_stream {
 
 };
 
+// Only bits that changed are touched per frame, each toggle goes into one flat list that's split per key at write time.
 struct _key_data_constructor {
 
-	u32 previous;
+	u32 previous{}, frame_count{};
 
-	std::array<std::vector<u32>, 32> key_sustain;
+	u32 toggle_count[32]{};
 
-	_key_data_constructor() {
-		previous = 0;
+	std::vector<u32> toggle; // frame << 5 | key
 
-		for (auto& k : key_sustain)
-			k.push_back(0);
+	template<rrf_gamemode mode>
+	bool tick(u32 keys) {
 
-	}
+		if constexpr (mode == rrf_gamemode::standard) {
+			if (keys & 4) keys &= ~u32(1);
+			if (keys & 8) keys &= ~u32(2);
+		}
 
-	bool tick(const u32 keys) {
+		// For some ungodly reason unknown to man, you can use the smoke key in CTB.
+		// Seems like an oversight so I'm just dropping it.
+		if constexpr (mode == rrf_gamemode::fruits)
+			keys &= 1;
 
 		const u32 delta{ keys ^ previous };
 
 		previous = keys;
 
-		for (size_t i{}; i < key_sustain.size(); ++i) {
+		for (u32 d{ delta }; d; d &= d - 1) {
 
-			if ((delta >> i) & 1)
-				key_sustain[i].push_back(0);
-			else ++key_sustain[i].back();
+			const u32 key{ (u32)std::countr_zero(d) };
+
+			++toggle_count[key];
+			toggle.push_back((frame_count << 5) | key);
 
 		}
 
+		++frame_count;
+
 		return (keys & delta) > 0;
 	}
 
-	bool tick_std(u32 keys) {
+	struct _sustain {
 
-		if (keys & 4) keys &= ~u32(1);
-		if (keys & 8) keys &= ~u32(2);
-
-		return tick(keys);
+		u32 offset[33];
+		std::vector<u32> data;
+	};
 
-	}
+	// Runs per key in the run_length layout, keys without a toggle have none.
+	_sustain sustain() const {
 
-};
+		_sustain s{};
 
-struct _key_data {
+		for (size_t i{}; i < 32; ++i)
+			s.offset[i + 1] = s.offset[i] + (toggle_count[i] ? toggle_count[i] + 1 : 0);
 
-	bit_stream k1;
-	bit_stream k2;
-	bit_stream m1;
-	bit_stream m2;
-	bit_stream smoke;
+		s.data.resize(s.offset[32]);
 
-	bit_stream composite_key() const {
+		u32 pos[32], last[32]{};
 
-		bit_stream comp{};
+		std::copy(s.offset, s.offset + 32, pos);
 
-		comp.append(k1);
-		comp.append(k2);
-		comp.append(m1);
-		comp.append(m2);
-		comp.append(smoke);
+		for (const auto t : toggle) {
 
-		return comp;
-	}
+			const u32 key{ t & 31 }, frame{ t >> 5 };
 
+			s.data[pos[key]] = pos[key] == s.offset[key] ? frame : frame - last[key] - 1;
 
+			++pos[key];
+			last[key] = frame;
 
-};
+		}
 
-struct _time_delta_stream {
+		for (size_t i{}; i < 32; ++i) {
+			if (toggle_count[i])
+				s.data[pos[i]] = frame_count - last[i] - 1;
+		}
 
-	std::vector<int> delta_table;
+		return s;
+	}
 
-	bit_stream table_stream;
-	bit_stream stream;
+};
 
-	void set_delta_table(const std::vector<std::pair<u32, u32>>& input) {
+namespace mania_chord {
 
-		delta_table.resize(input.size());
+	// Gaps and holds are short and repetitive, bytes let LZMA model them better than bucketed bits.
+	void add_count(std::vector<u8>& output, const u32 v) {
 
-		int* p = delta_table.data();
+		if (v < 255) [[likely]] {
+			output.push_back(u8(v));
+			return;
+		}
 
-		for (auto& [_exp, freq] : input)
-			*(p++) = std::bit_cast<int>(_exp);
+		output.push_back(255);
+		add_to_u8(output, v);
 
 	}
 
-	u32 get_table_index(const int d) const {
+	// u32 chord count, u8 bytes per raw chord, then the sections:
+	// frame gap per chord, list position per chord (0 is raw), raw chords, hold length per pressed column.
+	bit_stream encode(const _key_data_constructor& kd) {
 
-		for (size_t i{}, size{ delta_table.size() }; i < size; ++i) {
+		u32 width{};
 
-			if (delta_table[i] == d)
-				return i;
+		for (u32 i{}; i < 32; ++i) {
+			if (kd.toggle_count[i])
+				width = i + 1;
 		}
 
-		return 0;
-	}
-
+		const u32 mask_bytes{ std::max((width + 7) / 8, 1u) };
 
-};
-
-struct _rrf_construct {
-
-	u32 rrf_version, flags, frame_count, data_count;
+		std::vector<u32> frame{}, mask{}, hold{};
 
-	rrf_tag tag_table[256];
-	_rrf_data_block data_table[256];
+		u32 held{}, start[32]{}, open[32]{};
 
-	std::vector<u8> file_data;
+		for (const auto t : kd.toggle) {
 
-	void add_compress_stream(rrf_tag tag, const bit_stream& data, const CLzmaEncProps& props) {
+			const u32 f{ t >> 5 }, key{ t & 31 };
 
-		if (data_count == 255 || data.size() == 0) [[unlikely]]
-			return;
+			if (((held ^= 1u << key) >> key & 1) == 0) {
+				hold[open[key]] = f - start[key];
+				continue;
+			}
 
-		ON_SCOPE_EXIT( ++data_count; );
+			if (frame.size() == 0 || frame.back() != f) {
+				frame.push_back(f);
+				mask.push_back(0);
+			}
 
-		tag_table[data_count] = tag;
+			mask.back() |= 1u << key;
 
-		auto& dt{ data_table[data_count] };
+			start[key] = f;
+			open[key] = (u32)hold.size();
 
-		bool not_compressed{};
+			// Still held on the last frame unless a release comes.
+			hold.push_back(kd.frame_count - f);
 
-		const auto c{ comp::compress_conditional(data, props, not_compressed) };
+		}
 
-		if (not_compressed) {
+		bit_stream output{};
+		output.in_count = 8;
 
-			dt.is_compressed = 0;
-			dt.size = data.data.size();
+		auto& o{ output.data };
 
-			add_to_u8(file_data, data.data);
+		add_to_u8(o, (u32)frame.size());
+		o.push_back(u8(mask_bytes));
 
-		} else {
+		for (size_t i{}, last{ ~size_t(0) }; i < frame.size(); last = frame[i++])
+			add_count(o, u32(frame[i] - last - 1));
 
-			dt.is_compressed = 1;
-			dt.size = c.size();
+		std::vector<u32> raw{};
 
-			add_to_u8(file_data, c);
-		}
+		_model model{};
 
-	}
+		for (const auto m : mask) {
 
-	void add_stream(rrf_tag tag, const void* src, size_t size) {
+			const u32 code{ model.find(m) };
 
-		if (data_count == 255 || size == 0) [[unlikely]]
-			return;
+			o.push_back(u8(code));
 
-		ON_SCOPE_EXIT( ++data_count; );
+			if (code == 0)
+				raw.push_back(m);
 
-		tag_table[data_count] = tag;
+			model.update(m, code);
 
-		auto& dt{ data_table[data_count] };
-		
-		dt.is_compressed = 0;
-		dt.size = size;
+		}
 
-		const auto s{ file_data.size() };
+		for (const auto m : raw)
+			add_to_u8(o, &m, mask_bytes);
 
-		file_data.resize(s + size);
-		memcpy(file_data.data() + s, src, size);
+		for (const auto h : hold)
+			add_count(o, h - 1);
 
+		return output;
 	}
 
-	void add_stream(rrf_tag tag, const bit_stream& src) {
-		add_stream(tag, src.data.data(), src.data.size());
-	}
+}
 
-	u32 lowfi_count;
+struct _key_data {
 
-	_time_delta_stream time_delta;
+	bit_stream k1;
+	bit_stream k2;
+	bit_stream m1;
+	bit_stream m2;
+	bit_stream smoke;
 
-	_low_fidelity_delta_stream lowfi[2];
+	bit_stream composite_key() const {
 
-	std::vector<u32> sign[2];
+		bit_stream comp{};
+
+		comp.append(k1);
+		comp.append(k2);
+		comp.append(m1);
+		comp.append(m2);
+		comp.append(smoke);
+
+		return comp;
+	}
+
+
+
+};
+
+struct _osr_header {
+
+	std::vector<u8> bytes;
+
+	// Only used with RRF_FLAG::keep_life_bar, the life bar string is cut out of bytes.
+	bit_stream life_bar;
+
+};
+
+struct _rrf_construct {
+
+	u32 rrf_version, flags, frame_count, data_count;
+
+	rrf_tag tag_table[256];
+	_rrf_data_block data_table[256];
+
+	std::vector<u8> file_data;
+
+	void add_compress_stream(rrf_tag tag, const bit_stream& data, const CLzmaEncProps& props) {
+
+		if (data_count == 255 || data.size() == 0) [[unlikely]]
+			return;
+
+		bool not_compressed{};
+
+		const auto c{ comp::compress_conditional(data, props, not_compressed) };
+
+		add_compressed_stream(tag, c, not_compressed);
+
+	}
+
+	// Output of comp::compress_conditional, not_compressed means c holds the raw bytes.
+	void add_compressed_stream(rrf_tag tag, const std::vector<char>& c, const bool not_compressed) {
+
+		if (data_count == 255 || c.size() == 0) [[unlikely]]
+			return;
+
+		ON_SCOPE_EXIT( ++data_count; );
+
+		tag_table[data_count] = tag;
+
+		auto& dt{ data_table[data_count] };
+
+		dt.is_compressed = !not_compressed;
+		dt.size = c.size();
+
+		add_to_u8(file_data, c);
+
+	}
+
+	void add_stream(rrf_tag tag, const void* src, size_t size) {
+
+		if (data_count == 255 || size == 0) [[unlikely]]
+			return;
+
+		ON_SCOPE_EXIT( ++data_count; );
+
+		tag_table[data_count] = tag;
+
+		auto& dt{ data_table[data_count] };
+		
+		dt.is_compressed = 0;
+		dt.size = size;
+
+		const auto s{ file_data.size() };
+
+		file_data.resize(s + size);
+		memcpy(file_data.data() + s, src, size);
+
+	}
+
+	void add_stream(rrf_tag tag, const bit_stream& src) {
+		add_stream(tag, src.data.data(), src.data.size());
+	}
+
+	void add_osr_header(const _osr_header& header) {
+
+		add_stream(rrf_tag::osr_header, header.bytes.data(), header.bytes.size());
+
+		if (flags & RRF_FLAG::keep_life_bar)
+			add_compress_stream(rrf_tag::life_bar, header.life_bar, comp::life_bar_prop());
+
+	}
+
+	u32 lowfi_count;
+
+	_low_fidelity_delta_stream lowfi[2];
+
+	bit_stream sign[2];
 
 	_exponent_stream exp[2];
 
 	_mantissa_stream man[2];
 
-	void write(const char* output_file, const _key_data_constructor& kd) {
+	// Keys go in last, after this the construct is complete.
+	void finish(const _key_data_constructor& kd) {
 
 		{
 
 			bit_stream key_data{};
 			key_data.in_count = 8;
 
+			const auto sustain{ kd.sustain() };
+
 			u32 active_flags{};
 
-			for (size_t i{}; i < kd.key_sustain.size(); ++i)
-				active_flags |= (kd.key_sustain[i].size() > 1) << i;
+			for (size_t i{}; i < 32; ++i)
+				active_flags |= u32(kd.toggle_count[i] != 0) << i;
 
 			add_to_u8(key_data.data, active_flags);
 
 			// Release sustains have a higher entropic state than pressing on average.
 
-			for (const auto& ks : kd.key_sustain) {
+			run_length::write(sustain.data, key_data, BUCKET_COMP_KEYS);
 
-				if (ks.size() <= 1)
-					continue;
+			bool not_compressed{};
+
+			auto c{ comp::compress_conditional(key_data, comp::composite_key_prop(key_data.size()), not_compressed) };
+			auto tag{ rrf_tag::key_bit_stream };
+
+			// Repeating chords and holds are cheaper coded across columns, per key sustains win on sparse maps.
+			if (flags & RRF_FLAG::gamemode_mania) {
+
+				const auto chord{ mania_chord::encode(kd) };
+
+				bool chord_not_compressed{};
+
+				auto chord_c{ comp::compress_conditional(chord, comp::composite_key_prop(chord.size()), chord_not_compressed) };
 
-				for (const auto& v : ks)
-					write_bucket(v, key_data, BUCKET_COMP_KEYS);
+				if (chord_c.size() < c.size()) {
+					c.swap(chord_c);
+					not_compressed = chord_not_compressed;
+					tag = rrf_tag::mania_key_chord;
+				}
 
 			}
 
-			add_compress_stream(rrf_tag::key_bit_stream, key_data, comp::composite_key_prop(key_data.size()));
+			add_compressed_stream(tag, c, not_compressed);
 
 		}
 
@@ -901,9 +1226,6 @@ struct _rrf_construct {
 			//puts("");
 			for (size_t i{}; i < data_count; ++i) {
 
-				if (tag_table[i] == rrf_tag::osr_header)
-					continue;
-
 				DIAG::OUTPUT_SIZE += data_table[i].size;
 				//printf("%i> %i|%i\n", tag_table[i], data_table[i].is_compressed, data_table[i].size);
 			}
@@ -911,568 +1233,1653 @@ struct _rrf_construct {
 
 		}
 
-		std::vector<u8> final_file{};
+		DIAG::using_screen = (flags & RRF_FLAG::using_screenspace) != 0;
+		DIAG::OUTPUT_SIZE = size();
 
-		final_file.reserve(256 * file_data.size());
+	}
 
-		final_file.resize(sizeof(_rrf_header));
+	_rrf_header header() const {
+		return { RRF_VERSION, flags, frame_count, data_count };
+	}
 
-		auto* h{ (_rrf_header*)final_file.data() };
+	// Set from rrf_encode_options::compact_header once the encode is done.
+	bool compact{ 1 };
 
-		h->version = RRF_VERSION;
-		h->flags = flags;
-		h->frame_count = frame_count;
-		h->data_count = data_count;
+	// What goes into the file, the header bytes then every block as a short prefix and its slice of file_data.
+	struct _layout {
 
-		add_to_u8(final_file, tag_table, data_count * sizeof(tag_table[0]));
-		add_to_u8(final_file, data_table, data_count * sizeof(data_table[0]));
+		struct _block {
+			size_t offset, size;
+			u8 prefix[compact_header::MAX_PREFIX], prefix_size;
+		};
 
-		add_to_u8(final_file, file_data);
+		std::vector<u8> head;
+		std::vector<_block> block;
 
-		DIAG::using_screen = (flags & RRF_FLAG::using_screenspace) != 0;
-		DIAG::OUTPUT_SIZE = final_file.size();
+		size_t size() const {
+
+			size_t s{ head.size() };
+
+			for (const auto& b : block)
+				s += b.prefix_size + b.size;
+
+			return s;
+		}
+
+	};
+
+	// Full header, tag table, block table then the blocks as they were added.
+	_layout full_layout() const {
+
+		_layout l{};
 
-		if(strlen(output_file))
-			write_file(output_file, final_file);
+		const auto h{ header() };
 
+		l.head.resize(sizeof(h) + data_count * (sizeof(tag_table[0]) + sizeof(data_table[0])));
+
+		memcpy(l.head.data(), &h, sizeof(h));
+		memcpy(l.head.data() + sizeof(h), tag_table, data_count * sizeof(tag_table[0]));
+		memcpy(l.head.data() + sizeof(h) + data_count * sizeof(tag_table[0]), data_table, data_count * sizeof(data_table[0]));
+
+		l.block.push_back({ 0, file_data.size(), {}, 0 });
+
+		return l;
 	}
 
-};
+	// See compact_header, false if a block has no place in the gamemode's order or shows up twice.
+	bool compact_layout(_layout& l) const {
 
-void encode_delta_time(const _osr& r, _rrf_construct& rrf) {
+		using namespace compact_header;
 
-	std::vector<int> delta_table{};
+		const auto tags{ order(get_gamemode(flags)) };
 
-	{
-		std::vector<std::pair<u32, u32>> temp{}; temp.reserve(64);
+		u32 index[64];
+		u64 mask{};
+
+		for (size_t i{}; i < data_count; ++i) {
+
+			const auto pos{ size_t(std::find(tags.begin(), tags.end(), tag_table[i]) - tags.begin()) };
+
+			if (pos == tags.size() || (mask >> pos & 1))
+				return 0;
+
+			mask |= u64(1) << pos;
+			index[pos] = u32(i);
+		}
+
+		size_t offset[256];
+
+		for (size_t i{}, o{}; i < data_count; o += data_table[i++].size)
+			offset[i] = o;
+
+		u8 head[1 + 10 * 3 + 10 * 64];
+		u8* h{ head };
+
+		*(h++) = MARKER;
+		h = put_varint(h, flags);
+		h = put_varint(h, frame_count);
+		h = put_varint(h, mask);
+
+		l.block.clear();
 
-		for (const auto& v : r)
-			unique_add(std::bit_cast<u32>(v.delta), temp);
+		for (size_t pos{}; pos < tags.size(); ++pos) {
 
-		std::sort(temp.begin(), temp.end(), pair_sort);
+			if ((mask >> pos & 1) == 0)
+				continue;
+
+			const auto i{ index[pos] };
+			const auto& dt{ data_table[i] };
+
+			_layout::_block b{ offset[i], dt.size, {}, 0 };
+
+			kind k{ dt.is_compressed ? kind::lzma : kind::raw };
+
+			if (const u8* const d{ file_data.data() + b.offset }; k == kind::lzma && b.size >= 4 + LZMA_PROPS_SIZE && (*(u32*)d & LZMA_SPLIT) == 0 && d[4] < 9 * 5 * 5) {
+
+				k = kind::lzma_short;
+
+				b.prefix_size = u8(put_varint(b.prefix, *(u32*)d) - b.prefix);
+				b.prefix[b.prefix_size++] = d[4];
+
+				b.offset += 4 + LZMA_PROPS_SIZE;
+				b.size -= 4 + LZMA_PROPS_SIZE;
+			}
+
+			h = put_varint(h, u64(b.prefix_size + b.size) << 2 | k);
 
-		delta_table.resize(temp.size());
+			l.block.push_back(b);
+		}
 
-		for (size_t i{}; i < temp.size(); ++i)
-			delta_table[i] = std::bit_cast<int>(temp[i].first);
+		l.head.assign(head, h);
 
+		return 1;
 	}
 
-	bit_stream BS{}; BS.data.reserve(r.size());
+	_layout layout() const {
 
-	{
-		// Nowhere near optimal, but it's simple and somewhat low impact
+		if (_layout l{}; compact && compact_layout(l))
+			return l;
+
+		return full_layout();
+	}
+
+	// Exact size of the file.
+	size_t size() const {
+		return layout().size();
+	}
 
-		small_write<5>(delta_table.size(), BS);
+	// output has to hold size() bytes.
+	void write(u8* output) const {
 
-		for (const auto& v : delta_table)
-			small_write<5>(v < 0 ? -v : v, BS);
+		const auto l{ layout() };
 
-		for (const auto& v : delta_table)
-			BS.push_back(v < 0);
+		memcpy(output, l.head.data(), l.head.size());
+		output += l.head.size();
 
-		rrf.add_stream(rrf_tag::time_delta_table, BS.data.data(), BS.data.size());
+		for (const auto& b : l.block) {
+
+			memcpy(output, b.prefix, b.prefix_size);
+			output += b.prefix_size;
+
+			if (b.size)
+				memcpy(output, file_data.data() + b.offset, b.size);
+
+			output += b.size;
+		}
 
 	}
 
-	BS.clear();
+	void write(std::vector<u8>& output) const {
 
-	{
+		output.resize(size());
 
-		const auto get_index = [&delta_table](const int v) {
+		write(output.data());
 
-			for (u32 i{}; i < delta_table.size(); ++i)
-				if (v == delta_table[i])
-					return i;
+	}
 
-			return (u32)0;
+	// The parts go out as they are, nothing gets joined into one buffer first.
+	bool write_file(const char* file_name) const {
 
-		};
-		
-		for (const auto& v : r) {
-			write_bucket(get_index(v.delta), BS, BUCKET_TIME_STREAM);
+		const auto l{ layout() };
+
+#ifndef _WIN32
+
+		const int fd{ ::open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644) };
+
+		if (fd < 0)
+			return 0;
+
+		ON_SCOPE_EXIT( ::close(fd); );
+
+		std::vector<iovec> part{ { (void*)l.head.data(), l.head.size() } };
+
+		for (const auto& b : l.block) {
+			part.push_back({ (void*)b.prefix, b.prefix_size });
+			part.push_back({ (void*)(file_data.data() + b.offset), b.size });
+		}
+
+		for (iovec* p{ part.data() }, * const end{ p + part.size() }; p != end;) {
+
+			auto r{ ::writev(fd, p, int(end - p)) };
+
+			if (r < 0) {
+
+				if (errno == EINTR)
+					continue;
+
+				return 0;
+			}
+
+			// Short write, skip what went out and go again.
+			for (; p != end && size_t(r) >= p->iov_len; ++p)
+				r -= p->iov_len;
+
+			if (p != end) {
+				p->iov_base = (u8*)p->iov_base + r;
+				p->iov_len -= size_t(r);
+			}
+
+		}
+
+		return 1;
+
+#else
+
+		std::ofstream file(file_name, std::ios::binary);
+
+		if (!file.is_open())
+			return 0;
+
+		file.write((const char*)l.head.data(), l.head.size());
+
+		for (const auto& b : l.block) {
+			file.write((const char*)b.prefix, b.prefix_size);
+			file.write((const char*)file_data.data() + b.offset, b.size);
 		}
 
-		rrf.add_compress_stream(rrf_tag::time_delta_stream, BS, comp::time_delta_prop(BS.size()));
+		return file.good();
 
+#endif
 	}
 
-}
+};
+
+namespace time_delta {
 
-float get_screen_ratio_single(const _osr& r, float R) {
+	constexpr u32 MAX_PERIOD{ 16 };
 
-	u32 flag{};
+	struct _encoded {
 
-	for (size_t i{ 2 }; i < std::max(r.size(), (size_t)1) - 1; ++i) {
+		bit_stream table;
 
-		const float sp{ r[i].y * R };
+		std::vector<char> stream;
+		bool not_compressed;
 
-		// osu! incorrectly rounds the floats as it serializes, this means every single replay is actually slightly incorrect.
-		// Funnily enough doing this pulls back more information than the default .osr format
-		constexpr static float epsilon{ 0.001f };
+		size_t size() const {
+			return table.data.size() + stream.size();
+		}
+
+	};
 
-		const int rounded{ (int)std::round(sp) };
+	_encoded encode(const int* delta, const size_t size) {
 
-		if (abs(std::round(sp) - sp) > epsilon)
-			return 0.f;
+		symbol::_int_table table{};
+
+		for (size_t i{}; i < size; ++i)
+			table.add(delta[i]);
+
+		table.build();
+
+		const auto& delta_table{ table.table };
+
+		_encoded r{};
+
+		{
+			// Nowhere near optimal, but it's simple and somewhat low impact
+
+			auto& BS{ r.table };
+
+			small_write<5>(delta_table.size(), BS);
 
-		flag |= std::bit_cast<u32>(rounded);
+			for (const auto& v : delta_table)
+				small_write<5>(v < 0 ? -v : v, BS);
 
+			for (const auto& v : delta_table)
+				BS.push_back(v < 0);
+
+		}
+
+		{
+
+			bit_stream BS{}; BS.data.reserve(size);
+
+			for (size_t i{}; i < size; ++i)
+				write_bucket(table.get(delta[i]), BS, BUCKET_TIME_STREAM);
+
+			r.stream = comp::compress_conditional(BS, comp::time_delta_prop(BS.size()), r.not_compressed);
+
+		}
+
+		return r;
+	}
+
+	// Tries every period with its most common sum, the one that predicts the most frames wins. Period 0 means none was found.
+	_time_cadence find_cadence(const _osr& r) {
+
+		_time_cadence best{};
+
+		// The first two frames and the seed frame at the end aren't part of the cadence.
+		if (r.size() < 64)
+			return best;
+
+		const int* const delta{ r.delta.data() + 2 };
+		const size_t size{ r.size() - 3 };
+
+		size_t best_hits{};
+
+		for (u32 period{ 1 }; period <= MAX_PERIOD; ++period) {
+
+			symbol::_int_table sums{};
+
+			for (size_t i{}; i + period <= size; i += period) {
+
+				int64_t sum{};
+
+				for (size_t z{}; z < period; ++z)
+					sum += delta[i + z];
+
+				// Only pathological replays get here, no cadence runs that long.
+				if (sum > INT_MAX || sum < INT_MIN)
+					continue;
+
+				sums.add(int(sum));
+			}
+
+			sums.build();
+
+			if (sums.table[0] <= 0)
+				continue;
+
+			_time_cadence c{ period, u32(sums.table[0]) };
+
+			size_t hits{};
+
+			for (size_t i{}; i < size; ++i) {
+				hits += c.predict() == delta[i];
+				c.update(delta[i]);
+			}
+
+			if (hits > best_hits) {
+				best_hits = hits;
+				best = { period, c.sum };
+			}
+
+		}
+
+		return best;
 	}
 
-	u32 in{};
-	_BitScanForward((unsigned long*)&in, flag);
+}
+
+// Deltas go through a table sorted by frequency, either directly or as residuals of a cadence when that's smaller.
+void encode_delta_time(const _osr& r, _rrf_construct& rrf) {
+
+	auto result{ time_delta::encode(r.delta.data(), r.size()) };
+
+	if (const auto cadence{ time_delta::find_cadence(r) }; cadence.period) {
+
+		std::vector<int> residual(r.size());
+
+		auto c{ cadence };
+
+		for (size_t i{}; i < r.size(); ++i) {
+			residual[i] = r.delta[i] - c.predict();
+			c.update(r.delta[i]);
+		}
+
+		auto model{ time_delta::encode(residual.data(), residual.size()) };
+
+		if (model.size() + 8 < result.size()) {
 
-	if (in != 0 && in < 8)
-		R /= float(1 << in);
+			const u32 info[2]{ cadence.period, cadence.sum };
+
+			rrf.add_stream(rrf_tag::time_delta_model, info, sizeof(info));
+
+			result = std::move(model);
+		}
+
+	}
+
+	rrf.add_stream(rrf_tag::time_delta_table, result.table);
+	rrf.add_compressed_stream(rrf_tag::time_delta_stream, result.stream, result.not_compressed);
 
-	return R;
 }
 
-float get_screen_ratio(const _osr& r) {
+// Recovers the step of values that are noisy integer multiples of it.
+namespace lattice {
 
-	constexpr std::array game_ratio{
-		//2.250000f,
-		//3.000000f,
-		//1.875000f,
-		//1.500000f,
-		//4.375000f,
-		//4.500000f,
-		//2.500000f,
-		//2.000000f,
-		//1.250000f,
-		//5.000000f,
-		//1.800000f,
-		//4.000000f,
-		//3.750000f,
-		//1.302083f
-		1.302083f,
-		1.800000f,
-		3.000000f,
-		3.750000f,
-		4.375000f,
-		4.000000f,
-		4.500000f,
-		5.000000f
-	};
+	// Continued fraction of x/y, the first convergent p/q that explains both values within the noise gives the step x/p.
+	float approx_gcd(const float x, const float y, const double noise, const double min_step) {
+
+		const double a{ std::max(x, y) }, b{ std::min(x, y) };
+
+		double f{ a / b }, term{ std::floor(f) };
+
+		double p0{ 1 }, q0{ 0 }, p1{ term }, q1{ 1 };
+
+		for (;;) {
+
+			if (std::abs(a * q1 - b * p1) <= noise * (p1 + q1) || a / p1 < min_step * 0.5)
+				return float(a / p1);
+
+			if (f - term < 1e-9)
+				return 0.f;
+
+			f = 1.0 / (f - term);
+			term = std::floor(f);
+
+			const double p2{ term * p1 + p0 }, q2{ term * q1 + q0 };
+
+			p0 = p1; q0 = q1;
+			p1 = p2; q1 = q2;
+		}
+
+	}
+
+	struct _step_estimator {
+
+		float noise, tolerance, min_step;
+
+		float step{}, largest{};
+
+		// Returns 0 once the values can't share a step of at least min_step.
+		bool add(const float v) {
+
+			if (v <= tolerance)
+				return 1;
+
+			largest = std::max(largest, v);
+
+			if (step != 0.f) {
+
+				const float q{ v / step };
+
+				// Values this far off a multiple of the current step mean the step is still too coarse.
+				if (::fabsf(q - ::roundf(q)) * step <= tolerance) [[likely]]
+					return 1;
+			}
+
+			step = step == 0.f ? v : approx_gcd(step, v, noise, min_step);
+
+			return step >= min_step;
+		}
+
+	};
+
+}
+
+// Screen space replays sit on a 1/R lattice, where R is the screen pixels per osu!pixel.
+// The lattice step is recovered with an approximate gcd over both axes, then every frame is checked against it.
+namespace screen_lattice {
+
+	// osu! incorrectly rounds the floats as it serializes, this means every single replay is actually slightly incorrect.
+	// Funnily enough doing this pulls back more information than the default .osr format
+	constexpr float EPSILON{ 0.001f };
+
+	constexpr float GCD_NOISE{ 2e-4f }, GCD_TOLERANCE{ 0.004f };
+
+	constexpr float MIN_RATIO{ 1.f }, MAX_RATIO{ 16.f };
+
+	// Every value has to land within EPSILON of an integer once scaled, bits collects the or of those integers.
+	bool fits(const float* v, const size_t count, const float R, u32& bits) {
+
+		size_t i{};
+
+#ifdef RRF_SSE2
+
+		const __m128i abs_mask{ _mm_set1_epi32(0x7fffffff) };
+		const __m128 ratio{ _mm_set1_ps(R) }, eps{ _mm_set1_ps(EPSILON) };
+
+		__m128i or_bits{ _mm_setzero_si128() };
+
+		for (; i + 4 <= count; i += 4) {
+
+			const __m128 s{ _mm_mul_ps(_mm_loadu_ps(v + i), ratio) };
+			const __m128i rounded{ _mm_cvtps_epi32(s) };
+
+			const __m128 error{ _mm_and_ps(_mm_sub_ps(s, _mm_cvtepi32_ps(rounded)), _mm_castsi128_ps(abs_mask)) };
+
+			if (_mm_movemask_ps(_mm_cmpgt_ps(error, eps)))
+				return 0;
+
+			or_bits = _mm_or_si128(or_bits, rounded);
+		}
+
+		or_bits = _mm_or_si128(or_bits, _mm_shuffle_epi32(or_bits, _MM_SHUFFLE(1, 0, 3, 2)));
+		or_bits = _mm_or_si128(or_bits, _mm_shuffle_epi32(or_bits, _MM_SHUFFLE(2, 3, 0, 1)));
+
+		bits |= (u32)_mm_cvtsi128_si32(or_bits);
+
+#endif
+
+		for (; i < count; ++i) {
+
+			const float s{ v[i] * R };
+
+			if (::fabsf(::roundf(s) - s) > EPSILON)
+				return 0;
+
+			bits |= (u32)(int)::roundf(s);
+		}
+
+		return 1;
+	}
+
+	// Small denominators first, most scales are simple fractions (1.8 = 9/5, 1.302083 = 125/96).
+	float snap_rational(const float R) {
+
+		for (u32 q{ 1 }; q <= 128; ++q) {
+
+			const double p{ std::round(double(R) * q) };
+
+			if (std::abs(double(R) * q - p) < 2e-5 * q)
+				return float(p / q);
+		}
+
+		return R;
+	}
+
+}
+
+float get_screen_ratio(const _osr& r) {
+
+	using namespace screen_lattice;
+
+	// The first two frames and the last one aren't real positions
+	if (r.size() <= 3)
+		return 0.f;
+
+	// x is quantised onto the same lattice when encoding, so both axes have to be on it.
+	const float* const axis[2]{ r.x.data() + 2, r.y.data() + 2 };
+	const size_t count{ r.size() - 3 };
+
+	lattice::_step_estimator e{ GCD_NOISE, GCD_TOLERANCE, 1.f / MAX_RATIO - GCD_TOLERANCE };
+
+	for (const float* const v : axis) {
+		for (size_t i{}; i < count; ++i) {
+			if (e.add(::fabsf(v[i])) == 0)
+				return 0.f;
+		}
+	}
+
+	if (e.step == 0.f)
+		return 0.f;
+
+	const float largest{ e.largest };
+
+	float R{ 1.f / e.step };
+
+	// A coarse lattice (the cursor only ever moved in steps of several pixels) is still a lattice.
+	if (R < MIN_RATIO)
+		R *= ::ceilf(MIN_RATIO / R);
+
+	// The largest value has the most digits of the scale in it.
+	if (const float k{ ::roundf(largest * R) }; k > 0.f)
+		R = k / largest;
+
+	for (const float candidate : { snap_rational(R), R }) {
+
+		u32 bits{};
+
+		if (candidate < MIN_RATIO || candidate > MAX_RATIO || fits(axis[0], count, candidate, bits) == 0 || fits(axis[1], count, candidate, bits) == 0)
+			continue;
+
+		float ratio{ candidate };
+
+		for (u32 in{ (u32)std::countr_zero(bits) }; in != 0 && in < 8 && ratio * 0.5f >= MIN_RATIO; --in)
+			ratio *= 0.5f;
+
+		return ratio;
+	}
+
+	return 0.f;
+}
+
+// Finds the sensitivity multiplier of raw input axes, see raw_lattice in rrf_shared.h.
+namespace raw_lattice {
+
+	// Key frame deltas are off by up to half an ulp of the position.
+	constexpr float GCD_NOISE{ 1e-4f }, GCD_TOLERANCE{ 1e-3f }, MIN_STEP{ 1.f / 256 };
+
+	constexpr int SEARCH_ULPS{ 64 };
+	constexpr size_t SEARCH_SAMPLES{ 512 };
+	constexpr size_t MIN_FRAMES{ 16 };
+
+	// An escape costs ~40 bits against a few for a count, past 1 in 16 the float streams are smaller.
+	constexpr size_t MAX_ESCAPE_RATIO{ 16 };
+
+	bool chains(const float prev, const float x, const float step, int& c) {
+
+		const float q{ (x - prev) / step };
+
+		if ((::fabsf(q) < float(1 << 24)) == 0)
+			return 0;
+
+		c = (int)::roundf(q);
+
+		return std::bit_cast<u32>(next(prev, c, step)) == std::bit_cast<u32>(x);
+	}
+
+	// Returns 0 when the axis isn't on a lattice.
+	float find_step(const float* x, const size_t count) {
+
+		if (count < MIN_FRAMES)
+			return 0.f;
+
+		lattice::_step_estimator e{ GCD_NOISE, GCD_TOLERANCE, MIN_STEP };
+
+		for (size_t i{ 1 }; i < count; ++i) {
+			if (e.add(::fabsf(x[i] - x[i - 1])) == 0)
+				return 0.f;
+		}
+
+		if (e.step == 0.f)
+			return 0.f;
+
+		// Least squares over every delta gets within a few ulps, the exact float is searched for around it.
+		double dc{}, cc{};
+
+		for (size_t i{ 1 }; i < count; ++i) {
+
+			const double d{ double(x[i]) - double(x[i - 1]) };
+			const double c{ std::round(d / e.step) };
+
+			dc += d * c;
+			cc += c * c;
+		}
+
+		if (cc == 0.0)
+			return 0.f;
+
+		const u32 estimate{ std::bit_cast<u32>(float(dc / cc)) };
+
+		const size_t samples{ std::min(count, SEARCH_SAMPLES) };
+
+		float best{};
+		size_t best_hits{};
+
+		for (int u{ -SEARCH_ULPS }; u <= SEARCH_ULPS; ++u) {
+
+			const float step{ std::bit_cast<float>(estimate + u) };
+
+			size_t hits{};
+
+			for (size_t i{ 1 }; i < samples; ++i) {
+				int c;
+				hits += chains(x[i - 1], x[i], step, c);
+			}
+
+			if (hits > best_hits) {
+				best = step;
+				best_hits = hits;
+			}
+
+		}
+
+		return best;
+	}
+
+	// Returns 0 if too many positions had to be escaped.
+	bool encode(const float* x, const size_t count, const float step, bit_stream& output) {
+
+		size_t escapes{};
+
+		float prev{};
+
+		for (size_t i{}; i < count; ++i) {
+
+			int c;
+
+			if (chains(prev, x[i], step, c)) [[likely]]
+				write_count(c, output);
+			else {
+				write_escape(x[i], output);
+				++escapes;
+			}
+
+			prev = x[i];
+		}
+
+		return escapes * MAX_ESCAPE_RATIO <= count;
+	}
+
+}
+
+// Raw input moves the cursor by whole mouse counts times a step. At sensitivity 1 that step is one screen pixel,
+// 1/scale osu!pixels, so frame to frame deltas land on a 1/scale lattice. Other sensitivities are left to raw_lattice.
+float get_playfield_scale(const _osr& r) {
+
+	constexpr std::array playfield_scale{
+		1.250000f,
+		1.302083f,
+		1.500000f,
+		1.800000f,
+		1.875000f,
+		2.000000f,
+		2.250000f,
+		2.500000f,
+		3.000000f,
+		3.750000f,
+		4.000000f,
+		4.375000f,
+		4.500000f,
+		5.000000f
+	};
+
+	constexpr float epsilon{ 0.01f };
+	constexpr size_t MIN_SAMPLES{ 16 };
+
+	// Smallest first, a lattice also fits every multiple of its scale.
+	for (const auto scale : playfield_scale) {
+
+		size_t samples{}, hits{};
+
+		for (const auto* c : { &r.x, &r.y }) {
+
+			for (size_t i{ 1 }; i < r.size(); ++i) {
+
+				const float d{ ((*c)[i] - (*c)[i - 1]) * scale };
+
+				if (d == 0.f)
+					continue;
+
+				++samples;
+				hits += ::fabsf(d - ::roundf(d)) <= epsilon;
+
+			}
+
+		}
+
+		if (samples >= MIN_SAMPLES && hits * 10 >= samples * 9)
+			return scale;
+
+	}
+
+	return 0.f;
+}
+
+struct rrf_encode_options {
+
+	rrf_quality quality{ rrf_quality::standard };
+
+	float max_error{ 0.5f }; // In osu!pixels, only for rrf_quality::max_error
+
+	// Only marathon replays reach twice this in one stream, below that a single dictionary compresses better.
+	size_t block_size{ 1 << 20 };
+
+	// Standard only, every strategy is tried and the smallest valid file kept. The winner goes to DIAG::strategy.
+	bool speculative{};
+
+	// Varint header without the per block tables, see compact_header. Older readers only know the full one.
+	bool compact_header{ 1 };
+
+	// Lowfi step used instead of the one quality picks, 0 for none. Speculative candidates set it.
+	float lowfi_resolution{};
+
+};
+
+float get_lowfi_resolution(const _osr& r, const rrf_encode_options& options) {
+
+	constexpr float FALLBACK_SCALE{ 2.25f }; // 1080p
+
+	if (options.lowfi_resolution > 0.f)
+		return options.lowfi_resolution;
+
+	switch (options.quality) {
+
+	case rrf_quality::coarse:
+		return 0.5f;
+
+	case rrf_quality::native:
+	case rrf_quality::exact: {
+
+		const auto scale{ get_playfield_scale(r) };
+
+		return scale != 0.f ? scale : FALLBACK_SCALE;
+	}
+
+	case rrf_quality::max_error: {
+
+		auto res{ get_playfield_scale(r) };
+
+		if (res == 0.f)
+			res = FALLBACK_SCALE;
+
+		// Rounding to a step of 1/res is off by at most 0.5/res.
+		const float min_res{ 0.5f / std::max(options.max_error, 1.f / 1024.f) };
+
+		while (res < min_res)
+			res *= 2.f;
+
+		while (res * 0.5f >= min_res)
+			res *= 0.5f;
+
+		return res;
+	}
+
+	default:
+		return 1.f;
+
+	}
+
+}
+
+bool encode_replay_screen_space(_rrf_construct& result, const _osr& r, const u32 flags, const _osr_header& osr_header = _osr_header{}) {
+
+	const auto screen_ratio{ get_screen_ratio(r) };
+
+	if (screen_ratio == 0.f)
+		return 0;
+
+	// Screen space snaps to the lattice, exact modes only take it if every frame comes back bit for bit.
+	if (flags & (RRF_FLAG::force_lossless | RRF_FLAG::lowfi_residual)) {
+
+		for (const auto* c : { &r.x, &r.y }) {
+
+			for (const auto v : *c) {
+				if (std::bit_cast<u32>(float((int)std::round(v * screen_ratio)) / screen_ratio) != std::bit_cast<u32>(v))
+					return 0;
+			}
+
+		}
+
+	}
+
+	result.flags = flags | RRF_FLAG::using_screenspace;
+	result.frame_count = r.size();
+
+	encode_delta_time(r, result);
+
+	result.add_osr_header(osr_header);
+
+	result.add_stream(rrf_tag::screen_space_info, &screen_ratio, 4);
+
+	_key_data_constructor kd{};
+
+	{
+
+		bit_stream SS_delta[2]{};
+		bit_stream SS_sign_sustain[2]{};
+
+		{
+
+			for (const auto k : r.keys)
+				kd.tick<rrf_gamemode::standard>(k);
+
+			const float* const O[2]{ r.x.data(), r.y.data() };
+
+			std::vector<int> delta(r.size());
+
+			for (size_t i{}; i < 2; ++i) {
+
+				int prev{};
+
+				for (size_t f{}; f < r.size(); ++f) {
+
+					const int v{ (int)std::round(O[i][f] * screen_ratio) };
+
+					delta[f] = v - prev;
+					prev = v;
+
+					write_bucket(delta[f] < 0 ? -delta[f] : delta[f], SS_delta[i], SCREEN_SPACE_DELTA);
+
+				}
+
+				run_length::write(run_length::sign_runs(delta.data(), delta.size()), SS_sign_sustain[i], SCREEN_SPACE_SIGN_SUSTAIN);
+
+			}
+
+		}
+
+		{
+
+			const auto& comp{ combine_bool_vector(SS_sign_sustain[0], SS_sign_sustain[1]) };
+
+			result.add_compress_stream(rrf_tag::screen_space_sign_sustain, comp, comp::screen_space_sign_sustain(comp.size()));
+
+		}
+
+		result.add_compress_stream(rrf_tag::screen_space_x_delta, SS_delta[0], comp::pos_delta_prop(SS_delta[0].size()));
+		result.add_compress_stream(rrf_tag::screen_space_y_delta, SS_delta[1], comp::pos_delta_prop(SS_delta[1].size()));
+
+		result.finish(kd);
+
+	}
+
+	return 1;
+
+}
+
+template<rrf_gamemode mode>
+void encode_taiko_mania(_rrf_construct& result, const _osr& r, const u32 flags, const _osr_header& osr_header = _osr_header{}) {
+
+	result.flags = flags;
+	result.frame_count = r.size();
+
+	result.add_osr_header(osr_header);
+
+	encode_delta_time(r, result);
+
+	_key_data_constructor kd{};
+
+	if constexpr (mode == rrf_gamemode::mania) {
+
+		struct _p {
+			u32 start;
+			float v;
+		};
+
+		std::vector<_p> scroll{}; scroll.reserve(32);
+
+		scroll.push_back({2,  r.y[2] });
+
+		for (size_t i{ 3 }; i < r.size(); ++i) {
+
+			if (scroll.back().v == r.y[i])
+				continue;
+			
+			scroll.push_back({u32(i), r.y[i]});
+
+		}
+
+		result.add_stream(rrf_tag::mania_scroll_data, ((u8*)scroll.data()) + 4, (scroll.size() * sizeof(scroll[0])) - 4);
+
+	}
+
+	for (const auto k : r.keys)
+		kd.tick<mode>(k);
+
+	result.finish(kd);
+
+}
+
+void encode_fruits(_rrf_construct& result, const _osr& r, const u32 flags, const _osr_header& osr_header = _osr_header{}) {
+
+	result.frame_count = r.size();
+	result.flags = flags;
+
+	result.add_osr_header(osr_header);
+
+	encode_delta_time(r, result);
+
+	_key_data_constructor kd{};
+
+	_mantissa_stream mantissa{};
+
+	mantissa.stream[0].data.reserve(r.size() * 2);
+	mantissa.stream[1].data.reserve(r.size());
+
+	_exponent_stream exponent{};
+
+	std::vector<u8> exp_data; exp_data.reserve(r.size());
+
+	for (size_t i{}; i < r.size(); ++i) {
+
+		// CTB is always clamped between 0-512, no sign data is required
+
+		kd.tick<rrf_gamemode::fruits>(r.keys[i]);
+
+		const floatp c{ r.x[i] };
+
+		exp_data.push_back(c.p.exponent);
+
+		mantissa.push_back(c.p.mantissa);
+
+	}
+
+	{
+
+		exponent.compress(exp_data);
+
+		result.add_stream(rrf_tag::fruits_exp_sustain, &exponent.chunk_count, 4);
+
+		result.add_stream(rrf_tag::game_space_float_x_exponent_absolute_table,
+			exponent.abs_table_stream
+		);
+
+		result.add_compress_stream(rrf_tag(rrf_tag::game_space_float_x_exponent_sustain),
+			exponent.sustain_data, comp::exp_sustain_prop()
+		);
+
+		result.add_compress_stream(rrf_tag::game_space_float_x_exponent_stream,
+			exponent.stream, comp::exp_stream_prop()
+		);
+
+		const auto& comp{ mantissa.get_comp() };
+
+		result.add_stream(rrf_tag::game_space_float_x_mantissa,
+			comp.data(), comp.size()
+		);
+
+	}
+
+	result.finish(kd);
+
+}
+
+void encode_game_space(_rrf_construct& result, const _osr& r, const u32 flags, const _osr_header& osr_header, const rrf_encode_options& options) {
+
+	result.frame_count = r.size();
+	result.flags = flags;
+
+	result.add_osr_header(osr_header);
+
+	encode_delta_time(r, result);
+
+
+	for (size_t i{}; i < 2; ++i) {
+		result.man[i].stream[0].data.reserve(r.size() * 2);
+		result.man[i].stream[1].data.reserve(r.size());
+	}
+
+	_key_data_constructor kd{};
+
+	// 1 is the default, 2.25 (1080p) costs ~1.7%
+	const float lowfi_resolution{ get_lowfi_resolution(r, options) };
+
+	_raw_lattice_info raw_info{};
+	bit_stream raw_count[2]{};
+
+	{
+
+		std::vector<int> lowfi_delta[2];
+
+		const float lowf_r{ 1.f / lowfi_resolution };
+
+		bit_stream residual{};
+
+		std::vector<u8> exp_data[2];
+
+		std::vector<float> key_pos[2];
+		key_pos[0].reserve(r.size());
+		key_pos[1].reserve(r.size());
+
+		int P_LOWFI[2]{};
+
+		const bool lossless{ (flags & RRF_FLAG::force_lossless) != 0 };
+		const bool with_residual{ (flags & RRF_FLAG::lowfi_residual) != 0 };
+
+		for (size_t f{}; f < r.size(); ++f) {
+
+			const float x{ r.x[f] }, y{ r.y[f] };
+			const u32 keys{ r.keys[f] };
+
+			const int lowfi[2]{
+				(int)::roundf(x * lowfi_resolution),
+				(int)::roundf(y * lowfi_resolution)
+			};
+
+			ON_SCOPE_EXIT(
+				P_LOWFI[0] = lowfi[0];
+				P_LOWFI[1] = lowfi[1];
+			);
+
+			kd.tick<rrf_gamemode::standard>(keys);
+
+			const bool is_key{ lossless || keys != 0 };
+
+			if (is_key == 0) {
+
+				++result.lowfi_count;
+
+				lowfi_delta[0].push_back(lowfi[0] - P_LOWFI[0] );
+				lowfi_delta[1].push_back(lowfi[1] - P_LOWFI[1] );
+
+				if (with_residual) {
+
+					// Distance in ulps from what the decoder rebuilds to the real value.
+					const float pos[2]{ x, y };
+
+					for (size_t i{}; i < 2; ++i) {
+
+						const u32 a{ ordered_float(pos[i]) }, b{ ordered_float(float(lowfi[i]) * lowf_r) };
+
+						write_bucket(a >= b ? a - b : b - a, residual, GAME_SPACE_LOWFI_RESIDUAL);
+
+						if (a != b)
+							residual.push_back(a < b);
+
+					}
+
+				}
+
+				continue;
+			}
+
+			floatp pos[2]{ x, y };
+
+			key_pos[0].push_back(x);
+			key_pos[1].push_back(y);
+
+			for (size_t i{}; i < 2; ++i) {
+
+				exp_data[i].push_back(pos[i].p.exponent);
+
+				result.man[i].push_back(pos[i].p.mantissa);
+
+			}
+
+		}
+
+		for (size_t i{}; i < 2; ++i) {
+
+			result.lowfi[i].compress(lowfi_delta[i]);
+
+			const float step{ raw_lattice::find_step(key_pos[i].data(), key_pos[i].size()) };
+
+			if (step != 0.f && raw_lattice::encode(key_pos[i].data(), key_pos[i].size(), step, raw_count[i])) {
+				raw_info.axis_mask |= 1 << i;
+				raw_info.step[i] = step;
+				continue;
+			}
+
+			raw_count[i].clear();
+			result.exp[i].compress(exp_data[i]);
+
+			run_length::write_adaptive(run_length::sign_runs(key_pos[i].data(), key_pos[i].size()), result.sign[i]);
+		}
+
+		result.add_compress_stream(rrf_tag::game_space_lowf_residual, residual, comp::lowf_residual_prop(residual.size()));
+
+	}
+
+	{
+
+		_game_space_info gsi{};
+
+		gsi.exp_sustain_count[0] = result.exp[0].chunk_count;
+		gsi.exp_sustain_count[1] = result.exp[1].chunk_count;
+		gsi.lowfi_count = result.lowfi_count;
+		gsi.lowfi_resolution = lowfi_resolution;
+		gsi.quality = u32((flags & RRF_FLAG::force_lossless) ? rrf_quality::lossless : options.quality);
+		gsi.lowf_delta_y_start_bit = result.lowfi[0].lowf_value.size();
+
+		result.add_stream(rrf_tag::game_space_info, &gsi, sizeof(gsi));
+
+	}
+
+
+	{
+
+		const auto sign_full{ combine_bool_vector(result.lowfi[0].sign_sustain, result.lowfi[1].sign_sustain) };
+
+		result.add_compress_stream(rrf_tag::game_space_lowf_sign,
+			sign_full, comp::lowf_sign_prop(sign_full.size())
+		);
+
+		const auto lowf_full{ combine_bool_vector(result.lowfi[0].lowf_value, result.lowfi[1].lowf_value) };
+
+		result.add_compress_stream(rrf_tag::game_space_lowf_delta,
+			lowf_full, comp::lowf_prop(lowf_full.size())
+		);
+
+	}
+
+	if (raw_info.axis_mask)
+		result.add_stream(rrf_tag::game_space_raw_info, &raw_info, sizeof(raw_info));
+
+	for (size_t i{}; i < 2; ++i) {		
+
+		if (raw_info.axis_mask & (1 << i)) {
+
+			result.add_compress_stream(rrf_tag(i + size_t(rrf_tag::game_space_raw_x_delta)),
+				raw_count[i], comp::raw_count_prop(raw_count[i].size())
+			);
+
+			continue;
+		}
+
+		result.add_compress_stream(rrf_tag(i + size_t(rrf_tag::game_space_float_x_sign_runs)),
+			result.sign[i], comp::lowf_sign_prop(result.sign[i].size())
+		);
+
+		result.add_stream(rrf_tag(i + size_t(rrf_tag::game_space_float_x_exponent_absolute_table)),
+			result.exp[i].abs_table_stream
+		);
+
+		result.add_compress_stream(rrf_tag(i + size_t(rrf_tag::game_space_float_x_exponent_sustain)),
+			result.exp[i].sustain_data, comp::exp_sustain_prop()
+		);
+		
+		result.add_compress_stream(rrf_tag(i + size_t(rrf_tag::game_space_float_x_exponent_stream)),
+			result.exp[i].stream, comp::exp_stream_prop()
+		);
+
+		const auto& comp{ result.man[i].get_comp() };
 
-	for (const auto& f : game_ratio) {
-		 
-		const auto ratio{ get_screen_ratio_single(r, f) };
+		result.add_stream(rrf_tag(i + size_t(rrf_tag::game_space_float_x_mantissa)),
+			comp.data(), comp.size()
+		);
 
-		if (ratio != 0.f) {
-			return ratio;
-		}
 	}
 
-	return 0.f;
-}
+	result.finish(kd);
 
-bool encode_replay_screen_space(const char* output_file, const _osr& r, const u32 flags, std::vector<u8> osr_header_bytes = std::vector<u8>{}) {
+}
 
-	const auto screen_ratio{ get_screen_ratio(r) };
+void encode_standard(_rrf_construct& result, const _osr& r, const u32 flags, const _osr_header& osr_header, const rrf_encode_options& options) {
 
-	if (screen_ratio == 0.f)
-		return 0;
+	// Residuals only pay off when positions sit close to the lowfi lattice, otherwise the plain float path is smaller.
+	if (options.quality == rrf_quality::exact && (flags & (RRF_FLAG::force_lossless | RRF_FLAG::lowfi_residual)) == 0) {
 
-	_rrf_construct result{};
+		_rrf_construct lossless{};
 
-	result.flags = flags | RRF_FLAG::using_screenspace;
-	result.frame_count = r.size();
+		encode_standard(lossless, r, flags | RRF_FLAG::force_lossless, osr_header, options);
+		encode_standard(result, r, flags | RRF_FLAG::lowfi_residual, osr_header, options);
 
-	encode_delta_time(r, result);
+		if (lossless.size() < result.size())
+			std::swap(lossless, result);
 
-	if (osr_header_bytes.size())
-		result.add_stream(rrf_tag::osr_header, osr_header_bytes.data(), osr_header_bytes.size());
+		DIAG::OUTPUT_SIZE = result.size();
 
-	result.add_stream(rrf_tag::screen_space_info, &screen_ratio, 4);
+		return;
+	}
+	
+	if (encode_replay_screen_space(result, r, flags, osr_header))
+		return;
 
-	_key_data_constructor kd{};
+	encode_game_space(result, r, flags, osr_header, options);
 
-	{
+}
 
-		bit_stream SS_delta[2]{};
-		bit_stream SS_sign_sustain[2]{};
+// In rrf_read.h, candidates are checked by decoding them again.
+bool rrf_to_frames(const u8* const raw_data, const size_t raw_size, _osr& output);
 
-		{
+// For recompaction in the background, costs one encode and decode per candidate.
+// A candidate is valid if its keys and times decode the same as the rule and no position moves further than the requested quality allows.
+void encode_speculative(_rrf_construct& result, const _osr& r, const u32 flags, const _osr_header& osr_header, const rrf_encode_options& options) {
 
-			struct _delta_int_stream {
+	const bool exact{ (flags & RRF_FLAG::force_lossless) || options.quality == rrf_quality::lossless || options.quality == rrf_quality::exact };
 
-				u32 sign_count;
-				int prev_value;
-				bool prev_sign;
+	const float resolution{ get_lowfi_resolution(r, options) };
 
-				void finish_sign(bit_stream& sign_stream) {
+	struct _plan {
+		rrf_strategy strategy;
+		float lowfi_resolution;
+	};
 
-					write_bucket(sign_count, sign_stream, SCREEN_SPACE_SIGN_SUSTAIN);
+	std::vector<_plan> plan{ { rrf_strategy::rule, 0.f } };
 
-					sign_count = 0;
+	// Exact already weighs the lossless encodings against each other.
+	if (options.quality != rrf_quality::exact) {
 
-				}
+		if (get_screen_ratio(r) != 0.f)
+			plan.push_back({ rrf_strategy::game_space, 0.f });
 
-				void push_back(const int v, bit_stream& delta_stream, bit_stream& sign_stream) {
+		if (exact == 0 && options.quality != rrf_quality::native)
+			plan.push_back({ rrf_strategy::native, 0.f });
 
-					ON_SCOPE_EXIT(prev_value = v; );
+		if ((flags & RRF_FLAG::lowfi_residual) == 0)
+			plan.push_back({ rrf_strategy::residual, 0.f });
 
-					const int delta{ v - prev_value };
+		if ((flags & RRF_FLAG::force_lossless) == 0 && options.quality != rrf_quality::lossless)
+			plan.push_back({ rrf_strategy::lossless, 0.f });
 
-					write_bucket(delta < 0 ? -delta : delta, delta_stream, SCREEN_SPACE_DELTA);
+	}
 
-					if (const auto new_sign{ delta < 0 }; delta != 0 && new_sign != prev_sign) {
+	// Coarser steps only stay within the tolerance where the cursor already sits on their lattice, under exact the residuals
+	// make up the difference so they are always valid. The max_error search finds the coarsest step on the playfield
+	// lattice that still rounds within half the rule's step.
+	if ((flags & RRF_FLAG::force_lossless) == 0 && options.quality != rrf_quality::lossless) {
 
-						write_bucket(sign_count, sign_stream, SCREEN_SPACE_SIGN_SUSTAIN);
+		for (float res{ resolution * 0.5f }; res >= resolution * (1.f / 8.f); res *= 0.5f)
+			plan.push_back({ rrf_strategy::lowfi_step, res });
 
-						prev_sign = new_sign;
-						sign_count = 0;
+		rrf_encode_options search{ options };
+		search.quality = rrf_quality::max_error;
+		search.max_error = 0.5f / resolution;
 
-					}
-					else
-						++sign_count;
+		if (const float res{ get_lowfi_resolution(r, search) }; options.quality != rrf_quality::exact && res != resolution)
+			plan.push_back({ rrf_strategy::lowfi_step, res });
 
-				}
+	}
 
-			};
+	std::vector<_rrf_construct> candidate(plan.size());
+	std::vector<_osr> decoded(plan.size());
+	std::vector<u8> valid(plan.size());
 
-			_delta_int_stream pos_delta_meta[2]{};
+	parallel_for(plan.size(), [&](const size_t i) {
 
-			for (auto& f : r) {
+		comp::block_size = options.block_size;
 
-				kd.tick_std(f.keys);
+		auto& c{ candidate[i] };
 
-				float* O{ (float*)&f.x };
+		switch (plan[i].strategy) {
 
-				for (size_t i{}; i < 2; ++i) {
-					
-					pos_delta_meta[i].push_back((int)std::round(O[i] * screen_ratio),
-						SS_delta[i],
-						SS_sign_sustain[i]
-					);
+		case rrf_strategy::rule:
+			encode_standard(c, r, flags, osr_header, options);
+			break;
 
-				}
+		case rrf_strategy::game_space:
+			encode_game_space(c, r, flags, osr_header, options);
+			break;
 
-			}
+		case rrf_strategy::native: {
 
-			for (size_t i{}; i < 2; ++i)
-				pos_delta_meta[i].finish_sign(SS_sign_sustain[i]);
+			rrf_encode_options native{ options };
+			native.quality = rrf_quality::native;
 
+			encode_game_space(c, r, flags, osr_header, native);
+			break;
 		}
 
-		{
+		case rrf_strategy::residual:
+			encode_standard(c, r, flags | RRF_FLAG::lowfi_residual, osr_header, options);
+			break;
 
-			const auto& comp{ combine_bool_vector(SS_sign_sustain[0], SS_sign_sustain[1]) };
+		case rrf_strategy::lossless:
+			encode_standard(c, r, flags | RRF_FLAG::force_lossless, osr_header, options);
+			break;
 
-			result.add_compress_stream(rrf_tag::screen_space_sign_sustain, comp, comp::screen_space_sign_sustain(comp.size()));
+		case rrf_strategy::lowfi_step: {
 
+			rrf_encode_options step{ options };
+			step.lowfi_resolution = plan[i].lowfi_resolution;
+
+			encode_game_space(c, r, options.quality == rrf_quality::exact ? flags | RRF_FLAG::lowfi_residual : flags, osr_header, step);
+			break;
 		}
 
-		result.add_compress_stream(rrf_tag::screen_space_x_delta, SS_delta[0], comp::pos_delta_prop(SS_delta[0].size()));
-		result.add_compress_stream(rrf_tag::screen_space_y_delta, SS_delta[1], comp::pos_delta_prop(SS_delta[1].size()));
+		}
 
-		result.write(output_file, kd);
+		std::vector<u8> file{};
+		c.write(file);
 
-	}
+		valid[i] = rrf_to_frames(file.data(), file.size(), decoded[i]) && decoded[i].size() == r.size();
 
-	return 1;
+	});
 
-}
+	ON_SCOPE_EXIT(
+		DIAG::using_screen = (result.flags & RRF_FLAG::using_screenspace) != 0;
+		DIAG::OUTPUT_SIZE = result.size();
+	);
 
-void encode_taiko_mania(const char* output_file, const _osr& r, const u32 flags, std::vector<u8> osr_header_bytes = std::vector<u8>{}) {
+	DIAG::strategy = rrf_strategy::rule;
 
-	_rrf_construct result{};
+	// The rule is what a plain encode gives, nothing to compare against if even that doesn't decode.
+	if (valid[0] == 0) {
+		std::swap(result, candidate[0]);
+		return;
+	}
 
-	if (osr_header_bytes.size())
-		result.add_stream(rrf_tag::osr_header, osr_header_bytes.data(), osr_header_bytes.size());
+	const auto max_error = [&](const _osr& d) {
 
-	result.flags = flags;
-	result.frame_count = r.size();
+		float e{};
 
-	encode_delta_time(r, result);
+		const auto axis = [&](const aligned_vector<float>& a, const aligned_vector<float>& b) {
 
-	_key_data_constructor kd{};
+			for (size_t f{}; f < a.size(); ++f) {
 
-	if (flags & RRF_FLAG::gamemode_mania) {
+				if (std::bit_cast<u32>(a[f]) == std::bit_cast<u32>(b[f]))
+					continue;
 
-		struct _p {
-			u32 start;
-			float v;
-		};
+				const float delta{ std::abs(a[f] - b[f]) };
 
-		std::vector<_p> scroll{}; scroll.reserve(32);
+				e = std::isnan(delta) ? INFINITY : std::max(e, delta);
+			}
 
-		scroll.push_back({2,  r[2].y });
+		};
 
-		for (size_t i{ 3 }; i < r.size(); ++i) {
+		axis(r.x, d.x);
+		axis(r.y, d.y);
 
-			if (scroll.back().v == r[i].y)
-				continue;
-			
-			scroll.push_back({i, r[i].y});
+		return e;
+	};
 
-		}
+	// Rounding to the lowfi step is off by at most half of it.
+	const float tolerance{ std::max(exact ? 0.f : 0.5f / resolution, max_error(decoded[0])) };
 
-		result.add_stream(rrf_tag::mania_scroll_data, ((u8*)scroll.data()) + 4, (scroll.size() * sizeof(scroll[0])) - 4);
+	size_t best{};
 
+	if (std::isinf(tolerance)) {
+		std::swap(result, candidate[0]);
+		return;
 	}
 
-	for (auto& f : r)
-		kd.tick(f.keys);
+	for (size_t i{ 1 }; i < plan.size(); ++i) {
 
-	result.write(output_file, kd);
+		const auto& d{ decoded[i] };
 
-}
+		if (valid[i] == 0 || candidate[i].size() >= candidate[best].size())
+			continue;
 
-void encode_fruits(const char* output_file, const _osr& r, const u32 flags, std::vector<u8> osr_header_bytes = std::vector<u8>{}) {
+		if (memcmp(d.delta.data(), decoded[0].delta.data(), r.size() * sizeof(int)) ||
+			memcmp(d.keys.data(), decoded[0].keys.data(), r.size() * sizeof(u32)))
+			continue;
 
-	_rrf_construct result{};
-	result.frame_count = r.size();
-	result.flags = flags;
+		if (max_error(d) <= tolerance)
+			best = i;
 
-	if (osr_header_bytes.size())
-		result.add_stream(rrf_tag::osr_header, osr_header_bytes.data(), osr_header_bytes.size());
+	}
 
-	encode_delta_time(r, result);
+	std::swap(result, candidate[best]);
 
-	_key_data_constructor kd{};
+	DIAG::strategy = plan[best].strategy;
 
-	_mantissa_stream mantissa{};
+}
 
-	mantissa.stream[0].data.reserve(r.size() * 2);
-	mantissa.stream[1].data.reserve(r.size());
+void encode_replay(_rrf_construct& result, _osr& r, u32 flags, const _osr_header& osr_header = _osr_header{},
+	const rrf_encode_options& options = rrf_encode_options{}) {
 
-	_exponent_stream exponent{};
+	const auto block_size{ comp::block_size };
 
-	std::vector<u8> exp_data; exp_data.reserve(r.size());
+	comp::block_size = options.block_size;
 
-	for (const auto& f : r) {
+	ON_SCOPE_EXIT( comp::block_size = block_size; );
 
-		// CTB is always clamped between 0-512, no sign data is required
+	// The tiers inside compare sizes with the default layout.
+	ON_SCOPE_EXIT(
+		result.compact = options.compact_header;
+		DIAG::OUTPUT_SIZE = result.size();
+	);
 
-		// For some ungodly reason unknown to man, you can use the smoke key in CTB.
-		// Seems like an oversight so I'm just dropping it.
-		kd.tick(f.keys & 1);
+	if (options.quality == rrf_quality::lossless)
+		flags |= RRF_FLAG::force_lossless;
 
-		const floatp c{ f.x };
+	switch (get_gamemode(flags)) {
 
-		exp_data.push_back(c.p.exponent);
+	case rrf_gamemode::mania:
 
-		mantissa.push_back(c.p.mantissa);
+		if (r.size() > 1) {
+			r.x[0] = 0.f; r.y[0] = 0.f;
+			r.x[1] = 0.f; r.y[1] = 0.f;
+		}
 
-	}
+		for (size_t i{}; i < r.size(); ++i)
+			r.keys[i] |= u32(r.x[i]) << 2;
 
-	{
+		return encode_taiko_mania<rrf_gamemode::mania>(result, r, flags, osr_header);
 
-		exponent.compress(exp_data);
+	case rrf_gamemode::taiko:
+		return encode_taiko_mania<rrf_gamemode::taiko>(result, r, flags, osr_header);
 
-		result.add_stream(rrf_tag::fruits_exp_sustain, &exponent.chunk_count, 4);
+	case rrf_gamemode::fruits:
+		return encode_fruits(result, r, flags, osr_header);
 
-		result.add_stream(rrf_tag::game_space_float_x_exponent_absolute_table,
-			exponent.abs_table_stream
-		);
+	default:
+		break;
+	}
 
-		result.add_compress_stream(rrf_tag(rrf_tag::game_space_float_x_exponent_sustain),
-			exponent.sustain_data, comp::exp_sustain_prop()
-		);
+	if (options.speculative)
+		return encode_speculative(result, r, flags, osr_header, options);
 
-		result.add_compress_stream(rrf_tag::game_space_float_x_exponent_stream,
-			exponent.stream, comp::exp_stream_prop()
-		);
+	encode_standard(result, r, flags, osr_header, options);
 
-		const auto& comp{ mantissa.get_comp() };
+}
 
-		result.add_stream(rrf_tag::game_space_float_x_mantissa,
-			comp.data(), comp.size()
-		);
+void encode_replay(std::vector<u8>& output, _osr& r, const u32 flags, const _osr_header& osr_header = _osr_header{},
+	const rrf_encode_options& options = rrf_encode_options{}) {
 
-	}
+	_rrf_construct result{};
+
+	encode_replay(result, r, flags, osr_header, options);
 
-	result.write(output_file, kd);
+	result.write(output);
 
 }
 
-void encode_replay(const char* output_file, _osr& r, const u32 flags, std::vector<u8> osr_header_bytes = std::vector<u8>{}) {
+namespace osr_text {
 
-	if (flags & (RRF_FLAG::gamemode_taiko | RRF_FLAG::gamemode_mania)) {
+	// osu! only ever writes short integers and floats with a handful of decimals.
+	// Those get parsed directly, anything else falls back to from_chars.
 
-		if (flags & RRF_FLAG::gamemode_mania) {
-			
-			if (r.size() > 1) {
-				r[0].x = 0.f; r[0].y = 0.f;
-				r[1].x = 0.f; r[1].y = 0.f;
+	constexpr float pow10_table[]{ 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+
+	template<typename T>
+	bool fast_int(const u8* p, const u8* const end, T& output) {
+
+		bool negative{};
+
+		if constexpr (std::is_signed_v<T>) {
+			if (p < end && *p == u8('-')) {
+				negative = 1;
+				++p;
 			}
+		}
+
+		if (p == end || end - p > 9)
+			return 0;
+
+		u32 v{};
+
+		for (; p < end; ++p) {
 
-			for (auto& f : r)
-				f.keys |= u32(f.x) << 2;
+			const u32 digit{ u32(*p) - u32('0') };
 
+			if (digit > 9)
+				return 0;
+
+			v = v * 10 + digit;
 		}
 
-		return encode_taiko_mania(output_file, r, flags, osr_header_bytes);
-	}
+		output = negative ? T(-int(v)) : T(v);
 
-	if (flags & RRF_FLAG::gamemode_fruits) {
-		return encode_fruits(output_file, r, flags, osr_header_bytes);
+		return 1;
 	}
-	
-	if (encode_replay_screen_space(output_file, r, flags, osr_header_bytes))
-		return;
 
-	_rrf_construct result{};
-	result.frame_count = r.size();
-	result.flags = flags;
+	bool fast_float(const u8* p, const u8* const end, float& output) {
 
-	if (osr_header_bytes.size())
-		result.add_stream(rrf_tag::osr_header, osr_header_bytes.data(), osr_header_bytes.size());
+		const bool negative{ p < end && *p == u8('-') };
 
-	encode_delta_time(r, result);
+		p += negative;
 
+		u32 mantissa{}, digit_count{}, decimal_count{};
+		bool has_point{};
 
-	for (size_t i{}; i < 2; ++i) {
-		result.man[i].stream[0].data.reserve(r.size() * 2);
-		result.man[i].stream[1].data.reserve(r.size());
-	}
+		for (; p < end; ++p) {
 
-	_key_data_constructor kd{};
+			if (*p == u8('.') && has_point == 0 && digit_count != 0) {
+				has_point = 1;
+				continue;
+			}
 
-	//constexpr float lowfi_resolution{ 2.25f }; // 1080p (~1.7% cost)
-	constexpr float lowfi_resolution{ 1.f };
+			const u32 digit{ u32(*p) - u32('0') };
 
-	{
+			if (digit > 9 || ++digit_count > 9)
+				return 0;
 
-		std::vector<int> lowfi_delta[2];
+			mantissa = mantissa * 10 + digit;
+			decimal_count += has_point;
 
-		std::vector<u8> exp_data[2];
+		}
 
-		result.sign[0].push_back({});
-		result.sign[1].push_back({});
+		// Both sides are exact floats, so the single division is correctly rounded - same result as from_chars.
+		if (digit_count == 0 || (has_point && decimal_count == 0) || mantissa > (1u << 24))
+			return 0;
 
-		int P_LOWFI[2]{};
-		bool P_SIGN[2]{};
+		const float v{ float(mantissa) / pow10_table[decimal_count] };
 
-		for (auto v : r) {
+		output = negative ? -v : v;
 
-			const int lowfi[2]{
-				(int)::roundf(v.x * lowfi_resolution),
-				(int)::roundf(v.y * lowfi_resolution)
-			};
+		return 1;
+	}
 
-			ON_SCOPE_EXIT(
-				P_LOWFI[0] = lowfi[0];
-				P_LOWFI[1] = lowfi[1];
-			);
+	template<typename T>
+	void parse_int(const u8* start, const u8* end, T& output) {
+		if (fast_int(start, end, output) == 0)
+			std::from_chars((const char*)start, (const char*)end, output);
+	}
 
-			const auto key_pressed{ kd.tick_std(v.keys) };
+	void parse_float(const u8* start, const u8* end, float& output) {
+		if (fast_float(start, end, output) == 0)
+			std::from_chars((const char*)start, (const char*)end, output);
+	}
 
-			const bool is_key{ (flags & RRF_FLAG::force_lossless) ||(v.keys != 0) };
+	void add_frame(const u8* start, const u8* end, const u8* const* sep, size_t sep_count, _osr& output) {
 
-			if (is_key == 0) {
+		if (start == end)
+			return;
 
-				++result.lowfi_count;
+		const u8* s[3]{ end, end, end };
 
-				lowfi_delta[0].push_back(lowfi[0] - P_LOWFI[0] );
-				lowfi_delta[1].push_back(lowfi[1] - P_LOWFI[1] );
+		for (size_t i{}; i < sep_count; ++i)
+			s[i] = sep[i];
 
-				continue;
-			}
+		_osr_frame f{};
 
-			floatp pos[2]{ v.x, v.y };
+		parse_int(start, s[0], f.delta);
+		parse_float(std::min(s[0] + 1, end), s[1], f.x);
+		parse_float(std::min(s[1] + 1, end), s[2], f.y);
+		parse_int(std::min(s[2] + 1, end), end, f.keys);
 
-			for (size_t i{}; i < 2; ++i) {
+		output.push_back(f);
 
-				exp_data[i].push_back(pos[i].p.exponent);
+	}
 
-				result.man[i].push_back(pos[i].p.mantissa);
+	// For a single frame without a trailing ','
 
-				if (P_SIGN[i] == pos[i].p.sign || pos[i].f == 0.f) [[likely]]
-					++result.sign[i].back();
-				else {
-					result.sign[i].push_back(1);
-					P_SIGN[i] = pos[i].p.sign;
-				}
+	void parse_frame(const u8* start, const u8* end, _osr& output) {
 
-			}
+		const u8* sep[3]{};
+		size_t sep_count{};
 
+		for (const u8* p{ start }; p < end && sep_count < 3; ++p) {
+			if (*p == u8('|'))
+				sep[sep_count++] = p;
 		}
 
-		for (size_t i{}; i < 2; ++i) {
-			result.lowfi[i].compress(lowfi_delta[i]);
-			result.exp[i].compress(exp_data[i]);
-		}
+		add_frame(start, end, sep, sep_count, output);
 
 	}
 
-	{
+	// Parses every ',' terminated frame in the range, returns the start of the unterminated remainder.
 
-		_game_space_info gsi{};
+	const u8* parse_frames(const u8* p, const u8* const end, _osr& output) {
 
-		gsi.exp_sustain_count[0] = result.exp[0].chunk_count;
-		gsi.exp_sustain_count[1] = result.exp[1].chunk_count;
-		gsi.lowfi_count = result.lowfi_count;
-		gsi.lowfi_resolution = lowfi_resolution;
-		gsi.lowf_delta_y_start_bit = result.lowfi[0].lowf_value.size();
+		const u8* frame_start{ p };
 
-		result.add_stream(rrf_tag::game_space_info, &gsi, sizeof(gsi));
+		const u8* sep[3]{};
+		size_t sep_count{};
 
-	}
+		const auto token = [&](const u8* t) {
 
+			if (*t == u8('|')) {
 
-	{
+				if (sep_count < 3)
+					sep[sep_count++] = t;
 
-		const auto sign_full{ combine_bool_vector(result.lowfi[0].sign_sustain, result.lowfi[1].sign_sustain) };
+				return;
+			}
 
-		result.add_compress_stream(rrf_tag::game_space_lowf_sign,
-			sign_full, comp::lowf_sign_prop(sign_full.size())
-		);
+			add_frame(frame_start, t, sep, sep_count, output);
 
-		const auto lowf_full{ combine_bool_vector(result.lowfi[0].lowf_value, result.lowfi[1].lowf_value) };
+			frame_start = t + 1;
+			sep_count = 0;
 
-		result.add_compress_stream(rrf_tag::game_space_lowf_delta,
-			lowf_full, comp::lowf_prop(lowf_full.size())
-		);
+		};
 
-	}
+#ifdef RRF_SSE2
 
-	for (size_t i{}; i < 2; ++i) {		
+		const __m128i comma{ _mm_set1_epi8(',') };
+		const __m128i pipe{ _mm_set1_epi8('|') };
 
-		result.add_stream(rrf_tag(i + size_t(rrf_tag::game_space_float_x_sign)),
-			result.sign[i].data(), result.sign[i].size() * sizeof(result.sign[i][0])
-		);
+		for (; p + 16 <= end; p += 16) {
 
-		result.add_stream(rrf_tag(i + size_t(rrf_tag::game_space_float_x_exponent_absolute_table)),
-			result.exp[i].abs_table_stream
-		);
+			const __m128i v{ _mm_loadu_si128((const __m128i*)p) };
 
-		result.add_compress_stream(rrf_tag(i + size_t(rrf_tag::game_space_float_x_exponent_sustain)),
-			result.exp[i].sustain_data, comp::exp_sustain_prop()
-		);
-		
-		result.add_compress_stream(rrf_tag(i + size_t(rrf_tag::game_space_float_x_exponent_stream)),
-			result.exp[i].stream, comp::exp_stream_prop()
-		);
+			u32 mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, pipe)));
 
-		const auto& comp{ result.man[i].get_comp() };
+			for (; mask; mask &= mask - 1)
+				token(p + std::countr_zero(mask));
 
-		result.add_stream(rrf_tag(i + size_t(rrf_tag::game_space_float_x_mantissa)),
-			comp.data(), comp.size()
-		);
+		}
 
-	}
+#endif
+
+		for (; p < end; ++p) {
+			if (*p == u8(',') || *p == u8('|'))
+				token(p);
+		}
 
-	result.write(output_file, kd);
+		return frame_start;
+	}
 
 }
 
-void osr_to_rrf(const char* in_file, const char* out_file, const u32 flags){
+bool osr_to_rrf(const u8* const raw_data, const size_t raw_size, const u32 flags, _rrf_construct& result,
+	const rrf_encode_options& options = rrf_encode_options{}) {
 
-	const auto& raw_file{read_file(in_file)};
+	if (raw_size < 128)
+		return 0;
 
-	if (raw_file.size() < 128)
-		return;
+	const u8*const file_end{ raw_data + raw_size };
 
-	const u8*const file_end{ raw_file.data() + raw_file.size() };
+	const u8* lzma_start{ raw_data };
+	size_t lzma_size{ raw_size };
 
-	const u8* lzma_start{ raw_file.data() };
-	size_t lzma_size{ raw_file.size() };
+	_osr_header header{};
 
-	std::vector<u8> header_bytes{};
+	u32 rrf_flags{ flags };
 
 	if (flags & RRF_FLAG::has_osr_header) {
 
@@ -1512,90 +2919,99 @@ void osr_to_rrf(const char* in_file, const char* out_file, const u32 flags){
 		padv(u8); // is_perfect
 		padv(u32); // mods
 
+		const u8* const life_bar_start{ lzma_start };
+
 		skip_string(); //life_bar
 
+		const u8* const life_bar_end{ lzma_start };
+
 		padv(u64); // time_stamp
 
-		add_to_u8(header_bytes, raw_file.data(), size_t(lzma_start - raw_file.data()));
+		if (lzma_start <= file_end && life_bar::encode(life_bar_start, life_bar_end, header.life_bar)) {
+
+			rrf_flags |= RRF_FLAG::keep_life_bar;
+
+			add_to_u8(header.bytes, raw_data, size_t(life_bar_start - raw_data));
+			add_to_u8(header.bytes, life_bar_end, size_t(lzma_start - life_bar_end));
+
+		} else
+			add_to_u8(header.bytes, raw_data, size_t(lzma_start - raw_data));
 
 		padv(u32); // lzma_size - is this in the raw stream too?
 
 		#undef padv
 
+		if (lzma_start >= file_end)
+			return 0;
+
 		lzma_size = size_t(file_end - lzma_start);
 
 	}
 
 	if (lzma_size <= 5 + 8)
-		return;
-
-	std::vector<u8> osr_string;
+		return 0;
 
 	DIAG::INPUT_SIZE = lzma_size;
 
-	size_t osr_size{ *(u32*)(lzma_start + 5) }, input_size{ lzma_size - (5 + 8) };
+	const size_t osr_size{ *(u32*)(lzma_start + 5) };
 
-	ELzmaStatus lzma_status{};
+	_osr replay_stream{}; replay_stream.reserve(osr_size / 20);
 
-	osr_string.resize(osr_size);
+	{
 
-	const auto d = LzmaDecode(osr_string.data(), &osr_size, lzma_start + 5 + 8, &input_size, lzma_start, 5,
-		LZMA_FINISH_END, &lzma_status, &lzma_allocFuncs
-	);
+		CLzmaDec state;
+		LzmaDec_Construct(&state);
 
-	if (osr_string.size() != osr_size)
-		return;
+		if (LzmaDec_Allocate(&state, lzma_start, LZMA_PROPS_SIZE, &lzma_allocFuncs) != SZ_OK)
+			return 0;
 
-	const u8* frame_start{ osr_string.data() };
+		ON_SCOPE_EXIT( LzmaDec_Free(&state, &lzma_allocFuncs); );
 
-	_osr replay_stream{}; replay_stream.reserve(osr_string.size() / 20);
+		LzmaDec_Init(&state);
 
-	const auto add_frame = [&](const u8* end) {
+		// Frames are parsed as the text comes out of the decoder, only a partial frame is carried over between chunks.
 
-		//end = std::min(end, file_end);
-		//frame_start = std::min(frame_start, file_end);
+		std::vector<u8> window(1 << 16);
 
-		if (frame_start == end)
-			return;
+		const u8* src{ lzma_start + 5 + 8 };
+		size_t src_left{ lzma_size - (5 + 8) }, carry{}, total{};
 
-		_osr_frame f{};
+		for (;;) {
 
-		const u8* sep[3]{ end,end,end };
-		size_t c{};
-		for (const u8* p{ frame_start };  p < end; ++p) {
+			if (carry == window.size()) [[unlikely]]
+				window.resize(window.size() * 2);
 
-			if (*p != u8('|'))
-				continue;
+			size_t out_size{ std::min(window.size() - carry, osr_size - total) }, in_size{ src_left };
 
-			sep[c++] = p;
+			ELzmaStatus lzma_status{};
 
-			if (c == 3)
-				break;
+			if (LzmaDec_DecodeToBuf(&state, window.data() + carry, &out_size, src, &in_size, LZMA_FINISH_ANY, &lzma_status) != SZ_OK)
+				return 0;
 
-		}
+			src += in_size;
+			src_left -= in_size;
+			total += out_size;
 
-		std::from_chars((const char*)frame_start, (const char*)sep[0], f.delta);
-		std::from_chars((const char*)sep[0] + 1, (const char*)sep[1], f.x);
-		std::from_chars((const char*)sep[1] + 1, (const char*)sep[2], f.y);
-		std::from_chars((const char*)sep[2] + 1, (const char*)end, f.keys);
+			const u8* const end{ window.data() + carry + out_size };
 
-		replay_stream.push_back(f);
+			if (total == osr_size) {
+				osr_text::parse_frame(osr_text::parse_frames(window.data(), end, replay_stream), end, replay_stream);
+				break;
+			}
 
-		frame_start = end + 1;
+			if (out_size == 0) // Truncated stream
+				return 0;
 
-	};
+			const u8* const rest{ osr_text::parse_frames(window.data(), end, replay_stream) };
 
-	for (size_t i{}, size{ osr_string.size() }; i < size; ++i) {
+			carry = size_t(end - rest);
+
+			memmove(window.data(), rest, carry);
 
-		if (osr_string[i] == u8(',')) {
-			add_frame(osr_string.data() + i);
-			continue;
 		}
 
 	}
 
-	add_frame(osr_string.data() + osr_string.size());
-
 	size_t seed{};
 
 	if (replay_stream.size()) { // Don't need to put in the last frame
@@ -1603,6 +3019,37 @@ void osr_to_rrf(const char* in_file, const char* out_file, const u32 flags){
 		replay_stream.pop_back();
 	}
 
-	encode_replay(out_file, replay_stream, flags, std::move(header_bytes));
+	encode_replay(result, replay_stream, rrf_flags, header, options);
+
+	return 1;
+}
+
+bool osr_to_rrf(const u8* const raw_data, const size_t raw_size, const u32 flags, std::vector<u8>& output,
+	const rrf_encode_options& options = rrf_encode_options{}) {
+
+	output.clear();
 
+	_rrf_construct result{};
+
+	if (osr_to_rrf(raw_data, raw_size, flags, result, options) == 0)
+		return 0;
+
+	result.write(output);
+
+	return 1;
+}
+
+bool osr_to_rrf(const char* in_file, const char* out_file, const u32 flags, const rrf_encode_options& options = rrf_encode_options{}) {
+
+	const auto& raw_file{ read_file(in_file) };
+
+	_rrf_construct result{};
+
+	if (osr_to_rrf(raw_file.data(), raw_file.size(), flags, result, options) == 0)
+		return 0;
+
+	if (strlen(out_file))
+		return result.write_file(out_file);
+
+	return 1;
 }
\ No newline at end of file